@@ -35,21 +35,10 @@ void utils::Sleep(int s)
 
 namespace
 {
+    // the pool replaces the broken connection the next time it is checked out or given back
     void SIGPIPEHandler(int)
     {
         spdlog::warn("SIGPIPE received.");
-        auto uv = UvHandler::GetUVHandler();
-        auto status = database::Database::GetDatabase()->CheckConnectStatus();
-        uv->SetDatabaseConnect(status);
-        if (status) {
-            return;
-        } else {
-            status = database::Database::GetDatabase()->Connect();
-            if (!status) {
-                spdlog::error("reconnecting to database failed. exiting...");
-                uv->StopLoop();
-            }
-        }
     }
 
     void SIGTERMHandler(int)
@@ -104,11 +93,21 @@ int main(int, const char *argv[])
 
     auto conf = ReadConfig(DEFAULT_CONFIG_FILE);
 
-    if (database::Database::InitDatabase(std::move(conf->connectionString))->Connect()) {
+    auto db = database::Database::InitDatabase(std::move(conf->connectionString),
+                                               conf->databaseConnections);
+    if (db->Connect()) {
         initProtobufLibrary();
         atexit(shutdownProtobufLibrary);
         SetupSignals();
-        UvHandler::GetUVHandler()->SetupNetwork();
+        UvHandler::GetUVHandler()->SetDatabaseConnect(true);
+        UvHandler::GetUVHandler()->SetFrameOption(conf->frameOption);
+        UvHandler::GetUVHandler()->SetWatermarks(conf->clientWatermarks, conf->globalWatermarks);
+        UvHandler::GetUVHandler()->SetMetricsInterval(conf->metricsInterval);
+        UvHandler::GetUVHandler()->SetIdleTimeouts(conf->idleTimeout, conf->heartbeatInterval);
+        UvHandler::GetUVHandler()->SetMaxFrameSize(conf->maxFrameSize);
+        UvHandler::GetUVHandler()->SetupWriter(
+            conf->writerThreads, conf->batchEvents, conf->batchLinger);
+        UvHandler::GetUVHandler()->SetupNetwork(DEFAULT_LISTEN_ADDRESS, conf->loops);
         UvHandler::GetUVHandler()->UvLoopRun();
 
         UvHandler::DestroyUvHandler();
@@ -8,69 +8,163 @@
 
 #include <spdlog/spdlog.h>
 
+#include <sstream>
+
 using namespace protobuf;
 using namespace spdlog;
 using namespace database;
 
-namespace
+void Client::writeSomething(CoreMessage &msg)
 {
-    struct _work {
-        Client *c;
-        LogPackage *p;
-    };
-
-    void InsertWindowsEvents(Client *c, LogPackage *l)
-    {
-        uv_work_t *w = new uv_work_t;
-        auto wo = new _work;
-        wo->c = c;
-        wo->p = l;
-        w->data = wo;
-
-        uv_queue_work(
-            UvHandler::GetUVHandler()->GetLoop(),
-            w,
-            [](uv_work_t *w) {
-                _work *wo = reinterpret_cast<_work *>(w->data);
-                try {
-                    Database::GetDatabase()->InsertWindowsEvents(*wo->c->_client,
-                                                                 wo->p->GetEvents());
-                    if (wo->p->NeedAccept()) {
-                        AcceptLastEventPackage c(wo->c->lid + 1);
-                        wo->c->writeSomething(c);
-                    }
-                } catch (pqxx::sql_error &) {
-                    RefusePackage r(wo->p->Id(), "Refuse: database exception");
-                    wo->c->writeSomething(r);
-                }
-            },
-            [](uv_work_t *w, int) {
-                _work *wo = reinterpret_cast<_work *>(w->data);
-                delete wo->p;
-                delete wo;
-            });
+    char *buf;
+    size_t size;
+    msg.toBytes(&buf, &size, option, &stats);
+    uvLoop->WriteToNetwork(this, buf, size);
+}
+
+void Client::reply(CoreMessage &msg)
+{
+    replies.Add(msg, option);
+}
+
+void Client::flushReplies()
+{
+    if (replies.Empty()) {
+        return;
     }
+    char *buf;
+    size_t size;
+    replies.Encode(&buf, &size, option, &stats);
+    uvLoop->WriteToNetwork(this, buf, size);
+}
 
-}  // namespace
+Client::~Client()
+{
+    int64_t events = 0, bytes = 0;
+    for (auto l : inserts) {
+        events += l->size();
+        bytes += l->Bytes();
+        delete l;
+    }
+    UvHandler::GetUVHandler()->AddPending(-events, -bytes);
+    if (readPaused) {
+        UvHandler::GetUVHandler()->ReadPaused(false);
+    }
+    for (auto &o : outbound) {
+        ReleaseBuffer(o.buf);
+    }
+    decoder.Reset();
+    delete clientSocket;
+}
 
-void Client::writeSomething(CoreMessage &msg)
+void Client::checkBackpressure()
+{
+    auto h = UvHandler::GetUVHandler();
+    const auto &watermarks = h->GetClientWatermarks();
+    if (!readPaused) {
+        if (!watermarks.Above(pendingEvents, pendingBytes) && !h->Saturated()) {
+            return;
+        }
+        // the socket buffers fill up and TCP makes the agent wait
+        ReadStop();
+        readPaused = true;
+        h->ReadPaused(true);
+        spdlog::info("Client {} paused: {} events, {} bytes waiting for the database{}",
+                     _client == nullptr ? "(unknown)" : _client->_clientName,
+                     pendingEvents,
+                     pendingBytes,
+                     h->Saturated() ? ", server saturated" : "");
+    } else if (watermarks.Below(pendingEvents, pendingBytes) && !h->Saturated()
+               && !uv_is_closing(*this)) {
+        ReadStart();
+        readPaused = false;
+        h->ReadPaused(false);
+        spdlog::info("Client {} resumed",
+                     _client == nullptr ? "(unknown)" : _client->_clientName);
+    }
+}
+
+void Client::insertNext()
 {
-    UvHandler::GetUVHandler()->WriteToNetwork(msg, reinterpret_cast<uv_stream_t *>(clientSocket));
+    if (inserting || inserts.empty()) {
+        return;
+    }
+    inserting = true;
+    // the writer only sees the packages and the client's database row; the connection is
+    // looked up again by id once they are committed, as it may be closed meanwhile
+    auto i = new PendingInsert;
+    i->loop = uvLoop;
+    i->id = id;
+    i->client = _client;
+    i->events = 0;
+    i->stored = false;
+    i->packages.reserve(inserts.size());
+    for (auto l : inserts) {
+        i->packages.push_back(l);
+        i->events += l->size();
+    }
+    inserts.clear();
+    UvHandler::GetUVHandler()->GetWriter()->Submit(i);
+}
+
+void Client::insertDone(const PendingInsert &i)
+{
+    for (auto p : i.packages) {
+        if (!i.stored) {
+            RefusePackage r(p->Id(), "Refuse: database exception");
+            reply(r);
+        } else if (p->NeedAccept()) {
+            uint32_t last = p->empty() ? 0 : p->back().rid;
+            AcceptLastEventPackage a(last + 1, p->Id());
+            reply(a);
+        }
+        pendingEvents -= p->size();
+        pendingBytes -= p->Bytes();
+    }
+    flushReplies();
+    inserting = false;
+    insertNext();
+    checkBackpressure();
+}
+
+void Client::clientDisConnected()
+{
+    std::ostringstream os;
+    os << stats;
+    spdlog::info("Client {} disconnected. Frames: {}",
+                 _client == nullptr ? "(unknown)" : _client->_clientName,
+                 os.str());
 }
 
 void Client::readFromNetwork(char *buf, int size)
 {
-    std::lock_guard<std::mutex> lock(_mutex);
     decoder.read(buf, size);
-    CoreMessage *ret = decoder.GetProtobufMessage();
 
-    if (ret == nullptr) {
-        return;
+    // one read may complete several frames; handle all of them now instead of waiting for
+    // the next read callback.
+    CoreMessage *ret;
+    while ((ret = decoder.GetProtobufMessage()) != nullptr) {
+        processMessage(ret);
     }
+    flushReplies();
+    checkBackpressure();
+}
 
-    if (UvHandler::GetUVHandler()->GetDatabaseConnected()) {
+void Client::processMessage(CoreMessage *ret)
+{
+    if (!UvHandler::GetUVHandler()->GetDatabaseConnected()) {
         RefusePackage re(ret->Id(), "Refuse Package: database disconnected.");
-        writeSomething(re);
+        reply(re);
+        delete ret;
+        return;
+    }
+
+    // every other message belongs to the client this connection identified with CONNECT; a
+    // session frame names it by the id assigned then.
+    if (ret->Op() != Operation::CONNECT
+        && (_client == nullptr || (option.session != 0 && ret->Session() != option.session))) {
+        RefusePackage re(ret->Id(), "Refuse Package: unknown session.");
+        reply(re);
         delete ret;
         return;
     }
@@ -78,11 +172,22 @@ void Client::readFromNetwork(char *buf, int size)
     try {
         switch (ret->Op()) {
             case Operation::UPDATE_LOG: {
-                LogPackage *l = dynamic_cast<LogPackage *>(ret);
-                spdlog::info("Event Forwarder: Get {} events (Client {})", l->GetEvents().size());
-                lid = l->GetEvents().cend()->rid;
+                auto *l = dynamic_cast<LogPackageView *>(ret);
+                if (l == nullptr) {
+                    throw std::bad_cast();
+                }
+                spdlog::info("Event Forwarder: Get {} events (Client {})",
+                             l->size(),
+                             _client == nullptr ? "(unknown)" : _client->_clientName);
+                if (!l->empty()) {
+                    lid = l->back().rid;
+                }
 
-                InsertWindowsEvents(this, l);
+                pendingEvents += l->size();
+                pendingBytes += l->Bytes();
+                UvHandler::GetUVHandler()->AddPending(l->size(), l->Bytes());
+                inserts.push_back(l);
+                insertNext();
 
                 // this LogPackage was sent for insert events into database. DOTNOT destroy it.
                 // refer to client.cpp:30
@@ -92,21 +197,42 @@ void Client::readFromNetwork(char *buf, int size)
             case Operation::CONNECT: {
                 this->_client = database::Database ::GetDatabase()->GetClient(*ret);
                 if (this->_client) {
-                    ConnectPackage cp;
-                    writeSomething(cp);
+                    auto &peer = dynamic_cast<ConnectPackage &>(*ret);
+                    auto preferred = UvHandler::GetUVHandler()->GetFrameOption();
+                    preferred.session = UvHandler::GetUVHandler()->NextSession();
+                    preferred.batch = true;
+                    idleState.heartbeats = peer.Heartbeats();
+                    // the first heartbeat may be due before the idle timeout
+                    uvLoop->Watch(this);
+                    ConnectPackage cp(peer.Negotiate(preferred));
+                    option = cp.GetFrameOption();
+                    spdlog::info(
+                        "Client {} frames use {} (level {}), checksum {}, dictionary {}, "
+                        "session {}, window {}",
+                        _client->_clientName,
+                        CodecName(option.codec),
+                        option.level,
+                        ChecksumName(option.checksum),
+                        option.dictionary,
+                        option.session,
+                        option.window);
+                    reply(cp);
+                } else {
+                    RefusePackage re(ret->Id(), "Refuse Package: database disconnected.");
+                    reply(re);
                 }
             } break;
             case Operation::QUERY_LAST_EVENT: {
                 lid = database::Database::GetDatabase()->GetLastEventRecordID(*_client);
                 ReturnLastEventPackage lastPackage(lid + 1);
-                writeSomething(lastPackage);
+                reply(lastPackage);
             } break;
             default:
                 break;
         }
     } catch (std::bad_cast &) {
         RefusePackage r(ret->Id(), "Internal exception. bad_cast");
-        writeSomething(r);
+        reply(r);
     }
     delete ret;
 }
\ No newline at end of file
@@ -13,9 +13,16 @@
 #endif
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
 #include <string>
 #include <queue>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include <pqxx/pqxx>
 #include <uv.h>
@@ -24,12 +31,51 @@
 
 int GetCoreMessage(const protobuf::CoreMessage &);
 
+// limits of the events waiting for the database. Reading from agents stops above the high
+// watermark, in events or in bytes, and resumes once both are below the low one.
+struct Watermarks {
+    uint64_t highEvents;
+    uint64_t lowEvents;
+    uint64_t highBytes;
+    uint64_t lowBytes;
+
+    bool Above(uint64_t events, uint64_t bytes) const
+    {
+        return events > highEvents || bytes > highBytes;
+    }
+
+    bool Below(uint64_t events, uint64_t bytes) const
+    {
+        return events <= lowEvents && bytes <= lowBytes;
+    }
+};
+
 struct Config {
     std::string host;
     std::string password;
     std::string username;
     std::string connectionString;
     unsigned int port;
+    unsigned int loops;
+    // connections to postgres
+    unsigned int databaseConnections;
+    // threads inserting events, and when they commit a batch: once it holds `batchEvents'
+    // events or its oldest package waited `batchLinger' milliseconds
+    unsigned int writerThreads;
+    unsigned int batchEvents;
+    unsigned int batchLinger;
+    protobuf::FrameOption frameOption;
+    // of one connection, and of all of them
+    Watermarks clientWatermarks;
+    Watermarks globalWatermarks;
+    // seconds between two metrics lines, 0 for none
+    unsigned int metricsInterval;
+    // seconds of silence after which a connection is closed, and after which it is sent a
+    // heartbeat; 0 for never
+    unsigned int idleTimeout;
+    unsigned int heartbeatInterval;
+    // bytes of the largest frame accepted from an agent, serialized or compressed
+    size_t maxFrameSize;
 };
 
 struct Config *ReadConfig(const char *);
@@ -68,88 +114,412 @@ namespace database
         std::string _clientOsVersion;
         std::string _clientUniqueID;
         std::string _clientRegisterTime;
+
+        // the highest EventRecordID stored, read from the database at startup and raised by
+        // every insert since, so QUERY_LAST_EVENT is answered from memory
+        mutable std::atomic_uint32_t _lastEventRecordID{0};
+
+        void RaiseLastEventRecordID(uint32_t rid) const
+        {
+            auto last = _lastEventRecordID.load();
+            while (rid > last && !_lastEventRecordID.compare_exchange_weak(last, rid)) {
+            }
+        }
     };
 
 
+    struct PoolStatistics {
+        size_t size;
+        size_t open;
+        size_t idle;
+        uint64_t checkouts;
+        // checkouts that found every connection taken, and the time all checkouts waited
+        uint64_t waits;
+        uint64_t waitMicros;
+    };
+
     class Database
     {
-        pqxx::connection *conn;
+        // connections to postgres, each with its own prepared statements. The event loops
+        // and the writer threads check one out for every query, so batches of different
+        // writers run side by side on the server. Up to `poolSize' are open at a time.
+        std::vector<pqxx::connection *> _idle;
+        size_t _open;
+        size_t poolSize;
+        std::mutex _poolMutex;
+        std::condition_variable _released;
+
+        std::atomic<uint64_t> checkouts{0};
+        std::atomic<uint64_t> waits{0};
+        std::atomic<uint64_t> waitMicros{0};
+
+        // event ids taken from the sequence ahead of the batches using them, so that most
+        // batches go without that round trip
+        std::mutex _idsMutex;
+        std::deque<long> _eventIds;
 
         std::string connectionString;
 
+        // guards `_clients', which every event loop looks agents up in
+        std::mutex _clientsMutex;
         std::map<std::string, DbClient *> _clients;
 
-        void GetAllClients();
+        // a connection of the pool, given back when the lease ends
+        class Lease
+        {
+            Database *_db;
+            pqxx::connection *_conn;
+
+        public:
+            explicit Lease(Database *db) : _db(db), _conn(db->Acquire()) {}
+
+            ~Lease()
+            {
+                _db->Release(_conn);
+            }
+
+            Lease(const Lease &) = delete;
+            Lease &operator=(const Lease &) = delete;
+
+            pqxx::connection &operator*() const
+            {
+                return *_conn;
+            }
+        };
+
+        // a new connection with the statements prepared, throws pqxx::broken_connection
+        pqxx::connection *Open();
+        // health checked: a connection found closed, when taken or given back, is replaced
+        pqxx::connection *Acquire();
+        void Release(pqxx::connection *);
+
+        void GetAllClients(pqxx::connection &);
+
+        // `count' unused event ids, more of them reserved through `w' if too few
+        // are left
+        std::vector<long> TakeEventIds(pqxx::transaction_base &w, size_t count);
 
         static Database *_db;
 
         ~Database()
         {
-            delete conn;
+            for (auto c : _idle) {
+                delete c;
+            }
             for (auto &c : _clients) {
                 delete c.second;
             }
             _clients.clear();
         }
 
-        Database(std::string &&str) : connectionString(str)
+        Database(std::string &&str, size_t size)
+            : _open(0), poolSize(std::max<size_t>(1, size)), connectionString(str)
         {
-            conn = nullptr;
         }
 
     public:
-        int InsertWindowsEvents(const DbClient &, const std::vector<protobuf::Event> &);
+        // packages of any clients, inserted in one transaction
+        using EventBatch =
+            std::vector<std::pair<const DbClient *, const protobuf::LogPackageView *>>;
+
+        // whether the batch is committed; nothing of it is if not
+        bool InsertWindowsEvents(const EventBatch &);
 
-        int GetLastEventRecordID(const DbClient &);
+        uint32_t GetLastEventRecordID(const DbClient &);
 
+        // the client of a CONNECT, added if new; nullptr if the database failed
         DbClient *GetClient(const protobuf::CoreMessage &);
 
+        PoolStatistics GetPoolStatistics();
+
         static void DestroyDatabase()
         {
             delete _db;
             _db = nullptr;
         }
 
-        static Database *InitDatabase(std::string &&);
+        static Database *InitDatabase(std::string &&, size_t poolSize);
 
         static Database *GetDatabase();
 
         bool Connect();
-
-        bool CheckConnectStatus();
     };
 }  // namespace database
 
 
+// a hashed timer wheel of one-second slots: scheduling, cancelling and expiring an entry cost
+// O(1) however many there are. Entries due more than a turn ahead are passed over until their
+// turn comes.
+class TimerWheel
+{
+public:
+    struct Entry {
+        Entry *prev = nullptr;
+        Entry *next = nullptr;
+        uint64_t due = 0;
+        void *data = nullptr;
+    };
+
+    static constexpr size_t SLOTS = 512;
+
+    TimerWheel()
+    {
+        for (auto &s : slots) {
+            s.prev = s.next = &s;
+        }
+    }
+
+    void Start(uint64_t now)
+    {
+        current = now;
+    }
+
+    // (re)schedules `e' for second `due', the next one at the earliest
+    void Schedule(Entry *e, uint64_t due)
+    {
+        Cancel(e);
+        e->due = std::max(due, current + 1);
+        link(e, slots[e->due % SLOTS]);
+    }
+
+    void Cancel(Entry *e)
+    {
+        if (e->next != nullptr) {
+            e->prev->next = e->next;
+            e->next->prev = e->prev;
+            e->prev = e->next = nullptr;
+        }
+    }
+
+    // turns the wheel to second `now', calling `expired' with every entry due by then, no
+    // longer scheduled. `expired' may schedule it again.
+    template <class F>
+    void Advance(uint64_t now, F expired)
+    {
+        while (current < now) {
+            auto &slot = slots[++current % SLOTS];
+            // take the slot's entries first: those scheduled again may land in it
+            Entry due;
+            due.prev = due.next = &due;
+            if (slot.next != &slot) {
+                due.next = slot.next;
+                due.prev = slot.prev;
+                due.next->prev = due.prev->next = &due;
+                slot.prev = slot.next = &slot;
+            }
+            while (due.next != &due) {
+                auto e = due.next;
+                Cancel(e);
+                if (e->due > current) {
+                    link(e, slot);
+                } else {
+                    expired(e);
+                }
+            }
+        }
+    }
+
+private:
+    Entry slots[SLOTS];
+    uint64_t current = 0;
+
+    static void link(Entry *e, Entry &slot)
+    {
+        e->prev = slot.prev;
+        e->next = &slot;
+        slot.prev->next = e;
+        slot.prev = e;
+    }
+};
+
+struct Client;
+
+// names a connection of one loop. The low half is its slot in the ConnectionTable, the high
+// half the generation of the slot, so the id of a closed connection finds nothing even once
+// the slot is reused. 0 is no connection.
+using ConnectionId = uint64_t;
+
+// the connections of one loop in an array of slots, reused through a free list. Only the loop
+// thread adds, removes and looks up, without a lock; other threads keep ids and hand them to
+// the loop.
+class ConnectionTable
+{
+    static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+    struct Slot {
+        Client *client;
+        uint32_t generation;
+        uint32_t nextFree;
+    };
+
+    std::vector<Slot> slots;
+    uint32_t freeSlot = NO_SLOT;
+    std::atomic<size_t> count{0};
+
+public:
+    ConnectionId Add(Client *c)
+    {
+        uint32_t index;
+        if (freeSlot != NO_SLOT) {
+            index = freeSlot;
+            freeSlot = slots[index].nextFree;
+        } else {
+            index = static_cast<uint32_t>(slots.size());
+            slots.push_back({nullptr, 1, NO_SLOT});
+        }
+        slots[index].client = c;
+        count++;
+        return static_cast<ConnectionId>(slots[index].generation) << 32 | index;
+    }
+
+    void Remove(ConnectionId id)
+    {
+        auto index = static_cast<uint32_t>(id);
+        assert(Find(id) != nullptr);
+        auto &s = slots[index];
+        s.client = nullptr;
+        // generation 0 would make id 0 possible
+        if (++s.generation == 0) {
+            s.generation = 1;
+        }
+        s.nextFree = freeSlot;
+        freeSlot = index;
+        count--;
+    }
+
+    // the connection of `id', nullptr if it is closed
+    Client *Find(ConnectionId id) const
+    {
+        auto index = static_cast<uint32_t>(id);
+        if (index >= slots.size()) {
+            return nullptr;
+        }
+        const auto &s = slots[index];
+        return s.generation == static_cast<uint32_t>(id >> 32) ? s.client : nullptr;
+    }
+
+    // any thread
+    size_t Size() const
+    {
+        return count;
+    }
+
+    template <class F>
+    void ForEach(F f) const
+    {
+        for (const auto &s : slots) {
+            if (s.client != nullptr) {
+                f(s.client);
+            }
+        }
+    }
+};
+
+class UvLoop;
+
+// packages of one connection handed to the DatabaseWriter, in arrival order. They are
+// deleted with it.
+struct PendingInsert {
+    UvLoop *loop;
+    ConnectionId id;
+    const database::DbClient *client;
+    std::vector<protobuf::LogPackageView *> packages;
+    size_t events;
+    std::chrono::steady_clock::time_point queued;
+    // committed
+    bool stored;
+
+    ~PendingInsert()
+    {
+        for (auto p : packages) {
+            delete p;
+        }
+    }
+};
+
 struct Client {
     uv_tcp_t *clientSocket;
+    UvLoop *uvLoop;
+    ConnectionId id;
     database::DbClient *_client;
 
     std::atomic_uint32_t lid;
 
-    std::mutex _mutex;
-
     protobuf::ProtobufPacketDecoder decoder;
 
-    void clientDisConnected() {}
+    protobuf::FrameOption option;
+    protobuf::FrameStatistics stats;
+
+    // replies to the messages of one read, sent together once all of them are handled
+    protobuf::FrameBatch replies;
+
+    // frames waiting for the socket, oldest first; the first one may be partly written
+    struct Outbound {
+        char *buf;
+        size_t offset;
+        size_t length;
+    };
+    std::deque<Outbound> outbound;
+    // a write of this connection is in flight
+    bool writing;
+
+    // UPDATE_LOG packages waiting for the database. The agent keeps several in flight; they
+    // are inserted in arrival order, the packages of the last insert before any others, so
+    // acks are cumulative.
+    std::deque<protobuf::LogPackageView *> inserts;
+    bool inserting;
+
+    // events and bytes of `inserts' and of the packages being inserted
+    uint64_t pendingEvents;
+    uint64_t pendingBytes;
+    // reading was stopped by backpressure
+    bool readPaused;
+
+    // idle detection on the loop's timer wheel
+    TimerWheel::Entry idle;
+    protobuf::IdleState idleState;
+
+    // hands every package of `inserts' to the writer, unless some are being inserted
+    void insertNext();
+
+    // acknowledges or refuses the packages of `i' once the writer is done with them
+    void insertDone(const PendingInsert &i);
+
+    // stops or resumes reading as the watermarks say; on the loop thread
+    void checkBackpressure();
+
+    void processMessage(protobuf::CoreMessage *);
+
+    void clientDisConnected();
 
     void writeSomething(protobuf ::CoreMessage &msg);
 
+    void reply(protobuf::CoreMessage &msg);
+
+    void flushReplies();
+
     void readFromNetwork(char *buf, int size);
 
-    Client(uv_loop_t *loop)
+    Client(UvLoop *l, uv_loop_t *loop)
     {
+        uvLoop = l;
+        id = 0;
         lid = 1;
+        _client = nullptr;
+        writing = false;
+        inserting = false;
+        pendingEvents = pendingBytes = 0;
+        readPaused = false;
+        idle.data = this;
+        decoder.SetStatistics(&stats);
+        // events are only streamed into the database, never kept
+        decoder.DecodeLogPackageViews(true);
         clientSocket = new uv_tcp_t;
         uv_tcp_init(loop, clientSocket);
         clientSocket->data = this;
     }
 
-    ~Client()
-    {
-        decoder.Reset();
-        delete clientSocket;
-    }
+    ~Client();
 
     void printRemote()
     {
@@ -163,6 +533,8 @@ struct Client {
         }
     }
 
+    void ReadStart();
+
     void ReadStop()
     {
         uv_read_stop((uv_stream_t *)clientSocket);
@@ -185,25 +557,253 @@ struct Client {
 };
 
 
-class UvHandler
+// one event loop and the connections it accepted, each owned by the loop outright: reads,
+// decompression, verification and parsing of a connection all happen on its loop's thread.
+class UvLoop
 {
-    struct SendObject {
-        char *buf;
-        size_t length;
-        uv_stream_t *sock;
-    };
+    // a pooled uv_write_t with the buffers it writes, defined in uv.cpp
+    struct WriteRequest;
 
     uv_loop_t *loop;
     uv_tcp_t *tcp;
     uv_async_t *writeAsync;
     uv_async_t *stopAsync;
+    uv_async_t *resumeAsync;
+    uv_async_t *insertAsync;
+    uv_timer_t *wheelTimer;
+
+    TimerWheel wheel;
+
+    unsigned int index;
+    std::thread thread;
+    std::thread::id loopThread;
 
+    ConnectionTable connections;
+
+    // frames and finished inserts handed over by other threads since the loop last looked,
+    // guarded by _mutex. Once the loop is stopped, both are dropped instead.
+    struct Outgoing {
+        ConnectionId id;
+        char *buf;
+        size_t size;
+    };
     std::mutex _mutex;
+    std::vector<Outgoing> _outgoing;
+    std::vector<PendingInsert *> _inserted;
+    bool stopped;
+
+    // used by the loop thread only
+    std::vector<WriteRequest *> _freeRequests;
+
+    WriteRequest *AcquireWriteRequest();
 
-    std::atomic_bool dbConnected;
+    void ReleaseWriteRequest(WriteRequest *);
 
-    std::unordered_map<void *, Client *> _clientMap;
-    std::queue<SendObject> _sending_queue;
+    // starts writing the frames queued for `c', gathered into one vectored write
+    void Flush(Client *c);
+
+    // sends a heartbeat to, or closes, a connection silent for too long
+    void CheckIdle(Client *c);
+
+    // schedules the next idle check of `c'
+    void ScheduleIdle(Client *c);
+
+public:
+    // loop 0 is libuv's default loop
+    explicit UvLoop(unsigned int);
+
+    ~UvLoop();
+
+    unsigned int Index() const
+    {
+        return index;
+    }
+
+    uv_loop_t *GetLoop()
+    {
+        return loop;
+    }
+
+    // the loop's time in seconds, as of the current iteration
+    uint64_t Now() const
+    {
+        return uv_now(loop) / 1000;
+    }
+
+    // a read from `c': it is not idle. Otherwise the entry stays where it is, checked and
+    // scheduled again when due.
+    void Active(Client *c)
+    {
+        if (c->idleState.Active(Now())) {
+            ScheduleIdle(c);
+        }
+    }
+
+    // starts idle detection of a new connection
+    void Watch(Client *c)
+    {
+        c->idleState.lastActive = Now();
+        ScheduleIdle(c);
+    }
+
+    void AddClient(Client *c)
+    {
+        c->id = connections.Add(c);
+    }
+
+    // the connection of `id' if it is still open; on the loop thread
+    Client *Find(ConnectionId id) const
+    {
+        return connections.Find(id);
+    }
+
+    void ClientDisconnect(Client *);
+
+    // binds and listens on `addr'. With `reusePort' other loops may listen on the same port,
+    // and the kernel spreads new connections over all of them.
+    bool Listen(const sockaddr *addr, bool reusePort);
+
+    void _WriteToNetwork();
+
+    // hands back packages the writer is done with, from any thread
+    void Inserted(PendingInsert *);
+
+    void _InsertDone();
+
+    bool OnLoopThread() const
+    {
+        return std::this_thread::get_id() == loopThread;
+    }
+
+    // sends frames built into a buffer of the pool, released once written; on the loop
+    // thread. The socket is tried at once if nothing is queued ahead.
+    void WriteToNetwork(Client *, char *, size_t);
+
+    // the same from any thread, by id. Frames for a connection closed meanwhile are dropped.
+    void WriteToNetwork(ConnectionId, char *, size_t);
+
+    // runs the loop on the calling thread until it is stopped
+    void Run()
+    {
+        loopThread = std::this_thread::get_id();
+        uv_run(loop, UV_RUN_DEFAULT);
+    }
+
+    // runs the loop on a thread of its own
+    void Start()
+    {
+        thread = std::thread([this]() { Run(); });
+    }
+
+    void Join()
+    {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    // closes every handle of the loop, from any thread
+    void Stop()
+    {
+        uv_async_send(stopAsync);
+    }
+
+    // has the loop check its paused connections, from any thread
+    void Resume()
+    {
+        uv_async_send(resumeAsync);
+    }
+
+    size_t ClientCount() const
+    {
+        return connections.Size();
+    }
+};
+
+
+// inserts the packages of every connection of every loop in batches, a transaction each, so
+// the commit rate follows the batch settings rather than the number of agents. Packages go
+// back to their loops once committed, and only then are acknowledged.
+class DatabaseWriter
+{
+    std::vector<std::thread> threads;
+
+    unsigned int batchEvents;
+    std::chrono::milliseconds linger;
+
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::deque<PendingInsert *> _queue;
+    size_t _queuedEvents;
+    bool _stopping;
+
+    std::atomic<uint64_t> commits{0};
+    std::atomic<uint64_t> committedPackages{0};
+    std::atomic<uint64_t> committedEvents{0};
+    std::atomic<uint64_t> failures{0};
+
+    void Run();
+
+    void Write(std::vector<PendingInsert *> &);
+
+public:
+    DatabaseWriter(unsigned int events, unsigned int lingerMilliseconds)
+        : batchEvents(std::max(1u, events)),
+          linger(lingerMilliseconds),
+          _queuedEvents(0),
+          _stopping(false)
+    {
+    }
+
+    ~DatabaseWriter();
+
+    void Start(unsigned int threads);
+
+    // lets the batches being written finish; packages still queued are dropped unacknowledged
+    void Stop();
+
+    // from any loop thread
+    void Submit(PendingInsert *);
+
+    // logs the commits, the packages and events they held, and the batches that failed
+    void LogMetrics();
+};
+
+class UvHandler
+{
+    std::atomic_bool dbConnected{false};
+
+    std::atomic_uint32_t lastSession{0};
+
+    protobuf::FrameOption frameOption;
+
+    std::vector<UvLoop *> loops;
+
+    Watermarks clientWatermarks;
+    Watermarks globalWatermarks;
+
+    // events and bytes waiting for the database on every loop
+    std::atomic<uint64_t> pendingEvents{0};
+    std::atomic<uint64_t> pendingBytes{0};
+    // above the global high watermark, until below the low one
+    std::atomic_bool saturated{false};
+    // connections paused now, and how often any was
+    std::atomic<uint64_t> pausedClients{0};
+    std::atomic<uint64_t> readPauses{0};
+
+    unsigned int idleTimeout = 0;
+    unsigned int heartbeatInterval = 0;
+    std::atomic<uint64_t> reaped{0};
+
+    unsigned int metricsInterval = 0;
+    uv_timer_t *metricsTimer = nullptr;
+
+    size_t maxFrameSize = protobuf::PACKAGE_DEFAULT_MAX_FRAME_SIZE;
+
+    DatabaseWriter *writer = nullptr;
+    unsigned int writerThreads = 1;
+
+    void LogMetrics();
 
     static UvHandler *server;
 
@@ -211,17 +811,11 @@ class UvHandler
 
     ~UvHandler()
     {
-        _mutex.lock();
-        while (_sending_queue.size() > 0) {
-            auto &p = _sending_queue.front();
-            _sending_queue.pop();
-            delete[] p.buf;
+        for (auto l : loops) {
+            delete l;
         }
-        _mutex.unlock();
-        uv_loop_close(loop);
-        delete tcp;
-        delete writeAsync;
-        delete stopAsync;
+        delete metricsTimer;
+        delete writer;
     }
 
 
@@ -230,57 +824,122 @@ public:
 
     static UvHandler *GetUVHandler();
 
-    Client *RemoveClient(uv_stream_t *t)
+    bool GetDatabaseConnected() const
+    {
+        return dbConnected;
+    }
+
+    void SetDatabaseConnect(bool c)
+    {
+        dbConnected = c;
+    }
+
+    // the option offered to agents in the CONNECT exchange
+    const protobuf::FrameOption &GetFrameOption() const
+    {
+        return frameOption;
+    }
+
+    void SetFrameOption(const protobuf::FrameOption &option)
+    {
+        frameOption = option;
+    }
+
+    void SetWatermarks(const Watermarks &client, const Watermarks &global)
+    {
+        clientWatermarks = client;
+        globalWatermarks = global;
+    }
+
+    const Watermarks &GetClientWatermarks() const
     {
-        _mutex.lock();
-        Client *ret = nullptr;
-        const auto &p = _clientMap.find(t);
-        if (p != _clientMap.cend()) {
-            _clientMap.erase(p);
-            ret = p->second;
+        return clientWatermarks;
+    }
+
+    bool Saturated() const
+    {
+        return saturated;
+    }
+
+    // accounts for a package queued for the database (positive) or done with (negative)
+    void AddPending(int64_t events, int64_t bytes);
+
+    void ReadPaused(bool paused)
+    {
+        if (paused) {
+            pausedClients++;
+            readPauses++;
+        } else {
+            pausedClients--;
         }
-        _mutex.unlock();
-        return ret;
     }
 
-    void AddClient(Client *c)
+    void SetIdleTimeouts(unsigned int idle, unsigned int heartbeat)
     {
-        uv_stream_t *p = *c;
-        _mutex.lock();
-        assert(_clientMap.find(p) != _clientMap.end());
-        _clientMap.emplace(p, c);
-        _mutex.unlock();
+        idleTimeout = idle;
+        heartbeatInterval = heartbeat;
     }
 
-    bool GetDatabaseConnected() const
+    unsigned int IdleTimeout() const
     {
-        return dbConnected;
+        return idleTimeout;
     }
 
-    void SetDatabaseConnect(bool c)
+    unsigned int HeartbeatInterval() const
     {
-        dbConnected = c;
+        return heartbeatInterval;
     }
 
-    void _WriteToNetwork();
+    void CountReaped()
+    {
+        reaped++;
+    }
 
-    void WriteToNetwork(protobuf::CoreMessage &, uv_stream_t *);
+    // logs the pending work, the watermark state and the buffer pool every `seconds'
+    void SetMetricsInterval(unsigned int seconds)
+    {
+        metricsInterval = seconds;
+    }
 
-    void ClientDisconnect(Client *);
+    void SetMaxFrameSize(size_t size)
+    {
+        maxFrameSize = size;
+    }
 
-    void ReadFromNetwork(Client *, char *, ssize_t);
+    size_t MaxFrameSize() const
+    {
+        return maxFrameSize;
+    }
 
-    void SetupNetwork(const char * = DEFAULT_LISTEN_ADDRESS);
+    void SetupWriter(unsigned int threads, unsigned int batchEvents, unsigned int linger)
+    {
+        writer = new DatabaseWriter(batchEvents, linger);
+        writerThreads = std::max(1u, threads);
+    }
 
-    void UvLoopRun()
+    DatabaseWriter *GetWriter()
     {
-        uv_run(loop, UV_RUN_DEFAULT);
+        return writer;
     }
 
-    uv_loop_t *GetLoop()
+    // a session id for a new connection, never 0
+    uint32_t NextSession()
     {
-        return loop;
+        uint32_t s;
+        while ((s = ++lastSession) == 0) {
+        }
+        return s;
     }
 
+    // decodes the bytes of one read in place; the buffer stays the caller's
+    void ReadFromNetwork(Client *, char *, ssize_t);
+
+    // listens with `loops' event loops, 0 for one per core. Several loops need SO_REUSEPORT;
+    // without it the server runs one.
+    void SetupNetwork(const char * = DEFAULT_LISTEN_ADDRESS, unsigned int loops = 1);
+
+    // runs every loop, the first one on the calling thread, until all of them are stopped
+    void UvLoopRun();
+
     void StopLoop();
 };
@@ -30,6 +30,31 @@
             ret->dest = defaultValue;                         \
     } while (false);
 
+namespace
+{
+    // { "highEvents": 50000, "lowEvents": 10000, "highBytes": 67108864, "lowBytes": 16777216 }
+    void readWatermarks(const rapidjson::Value& v, const char* name, Watermarks& w)
+    {
+        if (!v.HasMember(name) || !v[name].IsObject()) {
+            return;
+        }
+        const auto& o = v[name];
+        for (auto p : {std::make_pair("highEvents", &w.highEvents),
+                       std::make_pair("lowEvents", &w.lowEvents),
+                       std::make_pair("highBytes", &w.highBytes),
+                       std::make_pair("lowBytes", &w.lowBytes)}) {
+            if (o.HasMember(p.first) && o[p.first].IsUint64()) {
+                *p.second = o[p.first].GetUint64();
+            }
+        }
+        if (w.lowEvents > w.highEvents || w.lowBytes > w.highBytes) {
+            spdlog::warn("{} low watermark above the high one, use the high one", name);
+            w.lowEvents = std::min(w.lowEvents, w.highEvents);
+            w.lowBytes = std::min(w.lowBytes, w.highBytes);
+        }
+    }
+}  // namespace
+
 struct Config* ReadConfig(const char* path)
 {
     char* buffer = nullptr;
@@ -97,6 +122,133 @@ struct Config* ReadConfig(const char* path)
         ret->port = 5432;
     }
 
+    // "compression": { "codec": "zstd", "level": 3, "checksum": "crc32c", "dictionary": "1.dict" }
+    // is what agents are asked to use; agents that cannot handle it fall back to zlib, crc32c
+    // and no dictionary.
+    if (document.HasMember("compression") && document["compression"].IsObject()) {
+        const auto& c = document["compression"];
+        protobuf::Codec codec;
+        if (c.HasMember("codec") && c["codec"].IsString()) {
+            if (protobuf::ParseCodec(c["codec"].GetString(), codec)) {
+                ret->frameOption.codec = codec;
+            } else {
+                spdlog::warn("Unknown compression codec {}, use {}",
+                             c["codec"].GetString(),
+                             protobuf::CodecName(ret->frameOption.codec));
+            }
+        }
+        if (c.HasMember("level") && c["level"].IsInt()) {
+            ret->frameOption.level = c["level"].GetInt();
+        }
+        protobuf::Checksum checksum;
+        if (c.HasMember("checksum") && c["checksum"].IsString()) {
+            if (protobuf::ParseChecksum(c["checksum"].GetString(), checksum)) {
+                ret->frameOption.checksum = checksum;
+            } else {
+                spdlog::warn("Unknown frame checksum {}, use {}",
+                             c["checksum"].GetString(),
+                             protobuf::ChecksumName(ret->frameOption.checksum));
+            }
+        }
+        if (c.HasMember("dictionary") && c["dictionary"].IsString()) {
+            uint8_t id;
+            if (protobuf::LoadDictionaryFile(c["dictionary"].GetString(), &id)) {
+                ret->frameOption.dictionary = id;
+                spdlog::info("Compression dictionary {} loaded from {}",
+                             id,
+                             c["dictionary"].GetString());
+            } else {
+                spdlog::warn("Load compression dictionary {} failed, compress without it",
+                             c["dictionary"].GetString());
+            }
+        }
+    }
+    // "loops": event loops serving agents, each on a thread of its own; 0 for one per core
+    ret->loops = 1;
+    if (document.HasMember("loops") && document["loops"].IsUint()) {
+        ret->loops = document["loops"].GetUint();
+    }
+    // "writerThreads": threads inserting events, each commits a batch once it holds
+    // "batchEvents" events or its oldest package waited "batchLinger" milliseconds
+    ret->writerThreads = 2;
+    ret->batchEvents = 5000;
+    ret->batchLinger = 20;
+    if (document.HasMember("writerThreads") && document["writerThreads"].IsUint()) {
+        ret->writerThreads = std::max(1u, document["writerThreads"].GetUint());
+    }
+    if (document.HasMember("batchEvents") && document["batchEvents"].IsUint()) {
+        ret->batchEvents = std::max(1u, document["batchEvents"].GetUint());
+    }
+    if (document.HasMember("batchLinger") && document["batchLinger"].IsUint()) {
+        ret->batchLinger = document["batchLinger"].GetUint();
+    }
+    // "databaseConnections": connections to postgres, by default one per writer plus one
+    // for the event loops. No fewer: with every connection held by a writer, a CONNECT would
+    // block its loop until a batch is committed.
+    ret->databaseConnections = ret->writerThreads + 1;
+    if (document.HasMember("databaseConnections") && document["databaseConnections"].IsUint()) {
+        auto connections = document["databaseConnections"].GetUint();
+        if (connections < ret->writerThreads + 1) {
+            spdlog::warn("{} database connections leave none to the event loops, use {}",
+                         connections,
+                         ret->writerThreads + 1);
+        }
+        ret->databaseConnections = std::max(ret->writerThreads + 1, connections);
+    }
+    // "backpressure": { "client": {...}, "global": {...} } limits the events waiting for the
+    // database per connection and in total, see readWatermarks()
+    ret->clientWatermarks = {50000, 10000, 64 << 20, 16 << 20};
+    ret->globalWatermarks = {500000, 100000, 512 << 20, 128 << 20};
+    if (document.HasMember("backpressure") && document["backpressure"].IsObject()) {
+        readWatermarks(document["backpressure"], "client", ret->clientWatermarks);
+        readWatermarks(document["backpressure"], "global", ret->globalWatermarks);
+    }
+    // "metricsInterval": seconds between two metrics lines in the log, 0 for none
+    ret->metricsInterval = 60;
+    if (document.HasMember("metricsInterval") && document["metricsInterval"].IsUint()) {
+        ret->metricsInterval = document["metricsInterval"].GetUint();
+    }
+    // "idleTimeout": seconds without a read after which a connection is closed, and
+    // "heartbeatInterval": seconds without one after which the agent is asked to answer a
+    // HEARTBEAT; 0 turns either off
+    ret->idleTimeout = 300;
+    ret->heartbeatInterval = 60;
+    if (document.HasMember("idleTimeout") && document["idleTimeout"].IsUint()) {
+        ret->idleTimeout = document["idleTimeout"].GetUint();
+    }
+    if (document.HasMember("heartbeatInterval") && document["heartbeatInterval"].IsUint()) {
+        ret->heartbeatInterval = document["heartbeatInterval"].GetUint();
+    }
+    // "maxFrameSize": bytes of the largest frame accepted from an agent; larger ones close the
+    // connection before anything is allocated for them
+    ret->maxFrameSize = protobuf::PACKAGE_DEFAULT_MAX_FRAME_SIZE;
+    if (document.HasMember("maxFrameSize") && document["maxFrameSize"].IsUint64()) {
+        ret->maxFrameSize = std::max<uint64_t>(1024, document["maxFrameSize"].GetUint64());
+    }
+    // "uploadWindow": how many UPDATE_LOG packages an agent may send ahead of the acks
+    if (document.HasMember("uploadWindow") && document["uploadWindow"].IsUint()) {
+        ret->frameOption.window = std::max(1u, document["uploadWindow"].GetUint());
+    }
+    if ((protobuf::SupportedCodecs() & (1u << static_cast<int>(ret->frameOption.codec))) == 0) {
+        spdlog::warn("Compression codec {} is not built in, use zlib",
+                     protobuf::CodecName(ret->frameOption.codec));
+        ret->frameOption.codec = protobuf::FrameOption().codec;
+        ret->frameOption.level = protobuf::FrameOption().level;
+    }
+    if (!protobuf::CodecLevelValid(ret->frameOption.codec, ret->frameOption.level)) {
+        spdlog::warn("Compression level {} is out of range for {}, use {}",
+                     ret->frameOption.level,
+                     protobuf::CodecName(ret->frameOption.codec),
+                     protobuf::FrameOption().level);
+        ret->frameOption.level = protobuf::FrameOption().level;
+    }
+    if ((protobuf::SupportedChecksums() & (1u << static_cast<int>(ret->frameOption.checksum)))
+        == 0) {
+        spdlog::warn("Frame checksum {} is not built in, use crc32c",
+                     protobuf::ChecksumName(ret->frameOption.checksum));
+        ret->frameOption.checksum = protobuf::Checksum::crc32c;
+    }
+
     // postgresql://[user[:password]@][netloc][:port][,...][/dbname][?param1=value1&...]
     std::string con = fmt::format(
         "postgresql://{username}:{password}@{host}:{port}/"
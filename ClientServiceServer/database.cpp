@@ -9,6 +9,9 @@
 #include <spdlog/spdlog.h>
 
 #include <cassert>
+#include <chrono>
+#include <memory>
+#include <string_view>
 
 using namespace pqxx;
 using namespace database;
@@ -27,6 +30,26 @@ namespace
         }
     }
 
+    // event ids reserved past those a batch needs, for the batches after it
+    constexpr size_t EVENT_ID_BLOCK = 10000;
+
+    // COPY "table"("column", ...) FROM STDIN. The names of postgres.sql are quoted and
+    // mixed-case, unquoted they fold to lower case and match nothing; libpqxx only quotes
+    // them itself since 7.7.
+    pqxx::stream_to copyInto(pqxx::transaction_base &w,
+                             std::string_view table,
+                             std::initializer_list<std::string_view> columns)
+    {
+#if PQXX_VERSION_MAJOR > 7 || (PQXX_VERSION_MAJOR == 7 && PQXX_VERSION_MINOR >= 7)
+        return pqxx::stream_to::table(w, {table}, columns);
+#else
+        std::vector<std::string> quoted;
+        for (auto c : columns) {
+            quoted.push_back(w.quote_name(std::string(c)));
+        }
+        return pqxx::stream_to(w, w.quote_name(std::string(table)), quoted);
+#endif
+    }
 
 }  // namespace
 
@@ -49,59 +72,84 @@ DbClient *Database::GetClient(const CoreMessage &msg)
     dc->_clientOsVersion = msg.GetOSVersion();
     dc->_clientUniqueID = msg.MachineID();
 
-    auto p = _clients.find(dc->_clientUniqueID);
-    if (p != _clients.end()) {
-        auto saved = p->second;
-        if (dc->_clientOsVersion != saved->_clientOsVersion) {
-            spdlog::info("Client #{}@{} OsVersion changed from {} to {}",
-                         saved->_clientID,
-                         saved->_clientUniqueID,
-                         saved->_clientOsVersion,
-                         dc->_clientOsVersion);
-
+    // the lock covers the map only, the statements below run while other loops look up theirs
+    DbClient *saved = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(_clientsMutex);
+        auto p = _clients.find(dc->_clientUniqueID);
+        if (p != _clients.end()) {
+            saved = p->second;
+        }
+    }
+    try {
+        Lease conn(this);
+        if (saved != nullptr) {
+            if (dc->_clientOsVersion != saved->_clientOsVersion) {
+                spdlog::info("Client #{}@{} OsVersion changed from {} to {}",
+                             saved->_clientID,
+                             saved->_clientUniqueID,
+                             saved->_clientOsVersion,
+                             dc->_clientOsVersion);
+
+                pqxx::work w(*conn);
+                std::string sql = "UPDATE \"Client\" SET \"ClientLastConnect\" = NOW(), "
+                                  "\"ClientOSVersion\" = ";
+
+                sql += w.quote(dc->_clientOsVersion);
+                sql += " WHERE \"ClientID\" = ";
+                sql += std::to_string(saved->_clientID);
+
+                DEBUG_PRINT_SQL;
+                auto r = w.exec(sql);
+                w.commit();
+                r.clear();
+            } else {
+                std::string sql =
+                    "UPDATE \"Client\" SET \"ClientLastConnect\" = NOW() WHERE \"ClientID\" = ";
+                sql += std::to_string(saved->_clientID);
+
+                DEBUG_PRINT_SQL;
+                pqxx::work w(*conn);
+                auto r = w.exec(sql);
+                w.commit();
+                r.clear();
+            }
+            delete dc;
+            // the same row on every connection of the agent, as it keeps the agent's last event
+            return saved;
+        } else {
             pqxx::work w(*conn);
-            std::string sql =
-                "UPDATE \"Client\" SET \"ClientLastConnect\" = NOW(), \"ClientOSVersion\" = '";
 
-            sql += w.quote(dc->_clientOsVersion);
-            sql += "' WHERE \"CliendID\" = ";
-            sql += std::to_string(dc->_clientID);
+            auto r = w.exec_prepared("insertClient",
+                                     dc->_clientName,                                     //1
+                                     dc->_clientOs == OsType::os_linux ? "Linux" : "Windows",  //2
+                                     dc->_clientOsVersion,                                //3
+                                     dc->_clientUniqueID);                                //4
 
-            DEBUG_PRINT_SQL;
-            auto r = w.exec(sql);
-            w.commit();
-            r.clear();
-        } else {
-            std::string sql =
-                "UPDATE \"Client\" SET \"ClientLastConnect\" = NOW() WHERE \"ClientID\" = ";
-            sql += std::to_string(dc->_clientID);
-
-            DEBUG_PRINT_SQL;
-            pqxx::work w(*conn);
-            auto r = w.exec(sql);
             w.commit();
+            if (r.size() == 1) {
+                dc->_clientID = r[0][0].as<long>();
+                spdlog::info("insert new client: #{}@{}", dc->_clientID, dc->_clientUniqueID);
+            } else {
+                assert(false);
+            }
             r.clear();
-        }
-        return p->second;
-    } else {
-        pqxx::work w(*conn);
 
-        auto r = w.exec_prepared("insertClient",
-                                 dc->_clientName,                                          //1
-                                 dc->_clientOs == OsType::os_linux ? "Linux" : "Windows",  //2
-                                 dc->_clientOsVersion,                                     //3
-                                 dc->_clientUniqueID);                                     //4
-
-        w.commit();
-        if (r.size() == 1) {
-            dc->_clientID = r[0][0].as<long>();
-            spdlog::info("insert new client: #{}@{}", dc->_clientID, dc->_clientUniqueID);
-        } else {
-            assert(false);
+            std::lock_guard<std::mutex> lock(_clientsMutex);
+            auto inserted = _clients.emplace(dc->_clientUniqueID, dc);
+            if (!inserted.second) {
+                // another connection of the agent got here first, with the same row
+                delete dc;
+            }
+            return inserted.first->second;
         }
-        r.clear();
-        return dc;
+    } catch (const pqxx::sql_error &se) {
+        spdlog::error("database exception: {}({}) ", se.what(), se.sqlstate());
+    } catch (const pqxx::broken_connection &bc) {
+        spdlog::error("database connection broken: {}", bc.what());
     }
+    delete dc;
+    return nullptr;
 }
 
 const std::string &dispatchEventSeverity(int s)
@@ -113,48 +161,106 @@ const std::string &dispatchEventSeverity(int s)
     return severity[s];
 }
 
-int database::Database::InsertWindowsEvents(const DbClient &c,
-                                            const std::vector<protobuf::Event> &evts)
+std::vector<long> Database::TakeEventIds(pqxx::transaction_base &w, size_t count)
+{
+    std::vector<long> ids;
+    ids.reserve(count);
+    {
+        std::lock_guard<std::mutex> lock(_idsMutex);
+        auto n = std::min(count, _eventIds.size());
+        ids.assign(_eventIds.begin(), _eventIds.begin() + n);
+        _eventIds.erase(_eventIds.begin(), _eventIds.begin() + n);
+    }
+    if (ids.size() == count) {
+        return ids;
+    }
+
+    // nextval() is not rolled back: the ids stay reserved even if the batch fails
+    auto missing = count - ids.size();
+    auto r = w.exec_prepared("reserveEventIDs", missing + EVENT_ID_BLOCK);
+    assert(r.size() == static_cast<pqxx::result::size_type>(missing + EVENT_ID_BLOCK));
+    std::vector<long> reserved;
+    reserved.reserve(r.size());
+    for (const auto &row : r) {
+        reserved.push_back(row[0].as<long>());
+    }
+    r.clear();
+    ids.insert(ids.end(), reserved.begin(), reserved.begin() + missing);
+
+    std::lock_guard<std::mutex> lock(_idsMutex);
+    _eventIds.insert(_eventIds.end(), reserved.begin() + missing, reserved.end());
+    return ids;
+}
+
+bool database::Database::InsertWindowsEvents(const EventBatch &batch)
 {
-    /*
-        INSERT INTO 
-        public."WindowsEvents"
-            ("ClientID", "EventSeverity", "EventTimestamp", "EventScope", "EventMessage", "EventRecordID")
-        VALUES ($1, $2, $3, $4, $5, $6) RETURNING "EventID";
-    */
-    pqxx::work w(*conn);
-    auto cid = c._clientID;
-    int inserted = 0;
+    // the whole batch is COPYed into both tables, a round trip for each table whatever the
+    // number of events. The event ids come from the sequence beforehand, mostly reserved
+    // by earlier batches, so the XML rows can refer to them without RETURNING.
+    size_t count = 0;
+    for (const auto &b : batch) {
+        count += b.second->size();
+    }
+    if (count == 0) {
+        return true;
+    }
     try {
-        for (const auto &evt : evts) {
-            auto insE = w.exec_prepared("insertEvent",
-                                        cid,
-                                        dispatchEventSeverity(evt.level),
-                                        evt.timeStamp,
-                                        evt.provider,
-                                        evt.format,
-                                        evt.rid);
-            insE.clear();
-            if (insE.size() == 1) {
-                // INSERT INTO public."WindowsEventXML"("EventID", "EventXML") VALUES ($1, $2)";
-                int eid = insE[0][0].as<int>();
-                auto r = w.exec_prepared("insertEventXML", std::to_string(eid), evt.xml);
-                r.clear();
-                inserted++;
+        Lease conn(this);
+        pqxx::work w(*conn);
+        auto ids = TakeEventIds(w, count);
+
+        // libpqxx only streams COPY in text format
+        auto events = copyInto(w,
+                               "WindowsEvents",
+                               {"EventID",
+                                "ClientID",
+                                "EventSeverity",
+                                "EventTimestamp",
+                                "EventScope",
+                                "EventMessage",
+                                "EventRecordID"});
+        size_t i = 0;
+        std::vector<uint32_t> lastRecordIDs(batch.size(), 0);
+        for (size_t j = 0; j < batch.size(); j++) {
+            auto cid = batch[j].first->_clientID;
+            for (const auto &evt : *batch[j].second) {
+                events.write_values(ids[i++],
+                                    cid,
+                                    dispatchEventSeverity(evt.level),
+                                    evt.timeStamp,
+                                    evt.provider,
+                                    evt.format,
+                                    evt.rid);
+                lastRecordIDs[j] = std::max(lastRecordIDs[j], evt.rid);
+            }
+        }
+        events.complete();
+
+        auto xml = copyInto(w, "WindowsEventsXML", {"EventID", "EventXML"});
+        i = 0;
+        for (const auto &b : batch) {
+            for (const auto &evt : *b.second) {
+                xml.write_values(ids[i++], evt.xml);
             }
         }
+        xml.complete();
+
         w.commit();
+        for (size_t j = 0; j < batch.size(); j++) {
+            batch[j].first->RaiseLastEventRecordID(lastRecordIDs[j]);
+        }
+        return true;
     } catch (const pqxx::sql_error &se) {
         spdlog::error("database exception: {}({}) ", se.what(), se.sqlstate());
-        w.abort();
+    } catch (const pqxx::broken_connection &bc) {
+        spdlog::error("database connection broken: {}", bc.what());
     }
-
-    return inserted;
+    return false;
 }
 
-Database *Database::InitDatabase(std::string &&cstr)
+Database *Database::InitDatabase(std::string &&cstr, size_t poolSize)
 {
-    return _db = new Database(std::move(cstr));
+    return _db = new Database(std::move(cstr), poolSize);
 }
 
 Database *Database::GetDatabase()
@@ -162,111 +268,166 @@ Database *Database::GetDatabase()
     return _db;
 }
 
-void Database::GetAllClients()
+void Database::GetAllClients(pqxx::connection &conn)
 {
-    pqxx::work w(*conn);
+    pqxx::work w(conn);
 
     pqxx::result clients = w.exec("SELECT * from \"Client\"");
+    // the last event of every agent, so that QUERY_LAST_EVENT is always answered from memory
+    pqxx::result lastEvents = w.exec("SELECT \"ClientID\", MAX(\"EventRecordID\") FROM "
+                                     "public.\"WindowsEvents\" GROUP BY \"ClientID\"");
 
     w.commit();
 
     spdlog::info("Startup: Get total {} clients from database", clients.size());
 
+    std::map<long, DbClient *> byID;
     for (auto c : clients) {
-        DbClient dbC;
+        auto dbC = new DbClient;
 
-        dbC._clientID = c[0].as<long>();
-        dbC._clientName = c[1].c_str();
-        dbC._clientOs = dispatch(c[2].as<std::string>());
-        dbC._clientOsVersion = c[3].c_str();
-        dbC._clientUniqueID = c[4].c_str();
-        dbC._clientRegisterTime = c[5].c_str();
+        dbC->_clientID = c[0].as<long>();
+        dbC->_clientName = c[1].c_str();
+        dbC->_clientOs = dispatch(c[2].as<std::string>());
+        dbC->_clientOsVersion = c[3].c_str();
+        dbC->_clientUniqueID = c[4].c_str();
+        dbC->_clientRegisterTime = c[5].c_str();
 
         spdlog::info("Startup: Client #{}@{}, name {}, OS: {} {}, added at {}",
-                     dbC._clientID,
-                     dbC._clientUniqueID,
-                     dbC._clientName,
+                     dbC->_clientID,
+                     dbC->_clientUniqueID,
+                     dbC->_clientName,
                      c[2].c_str(),
-                     dbC._clientOsVersion,
-                     dbC._clientRegisterTime);
+                     dbC->_clientOsVersion,
+                     dbC->_clientRegisterTime);
 
-        _clients[std::move(std::string(c[4].c_str()))] = new DbClient(std::move(dbC));
+        _clients[std::string(c[4].c_str())] = dbC;
+        byID[dbC->_clientID] = dbC;
     }
     assert(_clients.size() == clients.size());
     clients.clear();
+
+    for (auto e : lastEvents) {
+        auto p = byID.find(e[0].as<long>());
+        if (p != byID.end() && !e[1].is_null()) {
+            p->second->RaiseLastEventRecordID(e[1].as<uint32_t>());
+        }
+    }
+    lastEvents.clear();
 }
 
-bool Database::Connect()
+pqxx::connection *Database::Open()
 {
     char insertClient[] =
         "INSERT INTO public.\"Client\"("
         "\"ClientName\", \"ClientOS\", \"ClientOSVersion\", \"ClientUniqueID\","
         "\"ClientRegisterTime\", \"ClientLastConnect\") VALUES ($1, $2, $3, $4,  NOW(), NOW()) "
+        "ON CONFLICT (\"ClientUniqueID\") DO UPDATE SET \"ClientLastConnect\" = NOW() "
         "RETURNING *";
 
-    char insertEvent[] =
-        "INSERT INTO public.\"WindowsEvents\"("
-        "\"ClientID\", \"EventSeverity\", \"EventTimestamp\", "
-        "\"EventScope\", \"EventMessage\", \"EventRecordID\")"
-        "VALUES ($1, $2, $3, $4, $5, $6) RETURNING \"EventID\"";
+    // $1 event ids, see TakeEventIds()
+    char reserveEventIDs[] =
+        "SELECT nextval('\"WindowsEvents_EventID_seq\"') FROM generate_series(1, $1)";
+
+    std::unique_ptr<pqxx::connection> conn(new pqxx::connection(connectionString));
+    conn->prepare("reserveEventIDs", reserveEventIDs);
+    conn->prepare("insertClient", insertClient);
+    return conn.release();
+}
+
+pqxx::connection *Database::Acquire()
+{
+    auto start = std::chrono::steady_clock::now();
+    pqxx::connection *conn = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(_poolMutex);
+        if (_idle.empty() && _open >= poolSize) {
+            waits++;
+            _released.wait(lock, [this]() { return !_idle.empty() || _open < poolSize; });
+        }
+        if (!_idle.empty()) {
+            conn = _idle.back();
+            _idle.pop_back();
+        } else {
+            // opened below, outside of the lock
+            _open++;
+        }
+    }
+    checkouts++;
+    waitMicros += std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+
+    if (conn != nullptr && conn->is_open()) {
+        return conn;
+    }
+    if (conn != nullptr) {
+        spdlog::warn("DB: pooled connection closed, reconnecting");
+        delete conn;
+    }
+    try {
+        return Open();
+    } catch (const pqxx::broken_connection &) {
+        std::lock_guard<std::mutex> lock(_poolMutex);
+        _open--;
+        _released.notify_one();
+        throw;
+    }
+}
+
+void Database::Release(pqxx::connection *conn)
+{
+    bool open = conn->is_open();
+    if (!open) {
+        delete conn;
+    }
+    std::lock_guard<std::mutex> lock(_poolMutex);
+    if (open) {
+        _idle.push_back(conn);
+    } else {
+        _open--;
+    }
+    _released.notify_one();
+}
 
-    char insertEventXML[] =
-        "INSERT INTO public.\"WindowsEventXML\"(\"EventID\", \"EventXML\") VALUES ($1, $2)";
+PoolStatistics Database::GetPoolStatistics()
+{
+    std::lock_guard<std::mutex> lock(_poolMutex);
+    return {poolSize, _open, _idle.size(), checkouts.load(), waits.load(), waitMicros.load()};
+}
+
+bool Database::Connect()
+{
     spdlog::info("DB: libpqxx version {}", PQXX_VERSION);
 
+    pqxx::connection *conn = nullptr;
     pqxx::broken_connection bc;
 
-    for (int time = 0; time < 5; time++) {
+    for (int time = 0; time < 5 && conn == nullptr; time++) {
         try {
-            conn = new pqxx::connection(connectionString);
-            if (conn->is_open()) {
-                break;
-            }
+            conn = Open();
         } catch (pqxx::broken_connection &con) {
-            delete conn;
             utils::Sleep(std::pow(2, time));
             bc = con;
         }
     }
-    if (!conn->is_open()) {
+    if (conn == nullptr) {
         spdlog::error("connect to database server failed: {}", bc.what());
         return false;
     }
-    assert(conn->is_open());
     auto sv = conn->get_variable("server_version");
     spdlog::info("Connecting to database server successfully. Server version: {}", sv);
-    GetAllClients();
+    GetAllClients(*conn);
 
-    conn->prepare("insertEvent", insertEvent);
-    conn->prepare("insertEventXML", insertEventXML);
-    conn->prepare("insertClient", insertClient);
+    // the others are opened once more queries run at a time
+    std::lock_guard<std::mutex> lock(_poolMutex);
+    _open++;
+    _idle.push_back(conn);
+    spdlog::info("DB: pool of up to {} connections", poolSize);
     return true;
 }
 
-int database::Database::GetLastEventRecordID(const DbClient &dbc)
-{
-    std::string sql = "select \"EventRecordID\" from \"WindowsEvents\" WHERE \"ClientID\" = ";
-    sql += std::to_string(dbc._clientID);
-    DEBUG_PRINT_SQL;
-    pqxx::work w(*conn);
-    auto r = w.exec(sql);
-    int ret = 0;
-
-    if (r.size() == 0) {
-        return 0;
-    } else {
-        for (const auto &c : r) {
-            int t = c[0].as<int>();
-            if (t > ret) {
-                ret = t;
-            }
-        }
-    }
-
-    return ret;
-}
-
-bool Database::CheckConnectStatus()
+uint32_t database::Database::GetLastEventRecordID(const DbClient &dbc)
 {
-    return conn->is_open();
+    // loaded at startup, inserts keep it up to date from then on
+    return dbc._lastEventRecordID;
 }
\ No newline at end of file
@@ -3,6 +3,9 @@
 
 #include <spdlog/spdlog.h>
 
+#include <algorithm>
+#include <sstream>
+
 using namespace protobuf;
 
 namespace
@@ -15,30 +18,41 @@ namespace
         ssize_t size;
     };
 
+    // reads go into buffers of the pool, returned as soon as the read is handled: only
+    // connections inside a read callback hold one, and the loop thread's cache serves the next
+    // read without touching the allocator. Sized to fill a 64 KiB class exactly.
+    constexpr size_t RECEIVE_BUFFER_SIZE = 64 * 1024 - BUFFER_HEADER_SIZE;
+
+    // frames of one connection gathered into a single write
+    constexpr unsigned int MAX_WRITE_BUFFERS = 16;
+
+    // write requests each loop keeps for reuse
+    constexpr size_t MAX_FREE_WRITE_REQUESTS = 64;
+
 }  // namespace
 
 
 ////// libuv callback functions
 
-void uvAllocCB(uv_handle_t *, size_t suggested_size, uv_buf_t *buf)
+void uvAllocCB(uv_handle_t *, size_t, uv_buf_t *buf)
 {
-    buf->base = new char[suggested_size];
-    buf->len = suggested_size;
+    buf->base = AcquireBuffer(RECEIVE_BUFFER_SIZE);
+    buf->len = RECEIVE_BUFFER_SIZE;
 }
 
 void uvCloseCB(uv_handle_t *handle)
 {
     Client *c = reinterpret_cast<Client *>(handle->data);
     c->clientDisConnected();
-    UvHandler::GetUVHandler()->ClientDisconnect(c);
+    c->uvLoop->ClientDisconnect(c);
     delete c;
 }
 
 void uvReadCB(uv_stream_t *client, ssize_t nread, const uv_buf_t *buf)
 {
     Client *c = reinterpret_cast<Client *>(client->data);
-    auto cname = c->_client->_clientName;
     if (nread < 0) {
+        std::string cname = c->_client == nullptr ? "(unknown)" : c->_client->_clientName;
         switch (nread) {
             case UV_EOF:
                 spdlog::info("Network closed. (Client: {})", cname);
@@ -51,12 +65,20 @@ void uvReadCB(uv_stream_t *client, ssize_t nread, const uv_buf_t *buf)
             default:
                 spdlog::warn("Network read error {}. (Client: {})", uv_strerror(errno), cname);
         }
-        if (buf->base != nullptr) {
-            delete[] buf;
-        }
     } else if (nread > 0) {
+        c->uvLoop->Active(c);
         UvHandler::GetUVHandler()->ReadFromNetwork(c, buf->base, nread);
+        // a frame that cannot be decoded was dropped; the agent would wait for its reply
+        if (c->decoder.Errors() > 0 && !uv_is_closing(*c)) {
+            spdlog::warn("Client {} sent {} frame(s) that cannot be decoded, closing.",
+                         c->_client == nullptr ? "(unknown)" : c->_client->_clientName,
+                         c->decoder.Errors());
+            c->ReadStop();
+            uv_close(*c, uvCloseCB);
+        }
     }
+    // also handed back empty, e.g. on EAGAIN
+    ReleaseBuffer(buf->base);
 }
 
 void uvConnectCB(uv_stream_t *server, int status)
@@ -66,177 +88,520 @@ void uvConnectCB(uv_stream_t *server, int status)
         return;
     }
 
-    Client *client = new Client(UvHandler::GetUVHandler()->GetLoop());
-    UvHandler::GetUVHandler()->AddClient(client);
+    // the connection stays on the loop that accepted it
+    auto l = reinterpret_cast<UvLoop *>(server->data);
+    Client *client = new Client(l, l->GetLoop());
+    client->decoder.SetMaxFrameSize(UvHandler::GetUVHandler()->MaxFrameSize());
+    l->AddClient(client);
 
     if (uv_accept(server, *client) == 0) {
-        uv_read_start(*client, uvAllocCB, uvReadCB);
+        client->ReadStart();
+        l->Watch(client);
         client->printRemote();
     } else {
-        client->close();
+        uv_close(*client, uvCloseCB);
     }
 }
 
 ///// libuv callback functions end
 
+void Client::ReadStart()
+{
+    uv_read_start(*this, uvAllocCB, uvReadCB);
+}
 
-UvHandler *UvHandler::server = nullptr;
 
-UvHandler::UvHandler()
+struct UvLoop::WriteRequest {
+    uv_write_t req;
+    UvLoop *loop;
+    Client *client;
+    unsigned int count;
+    uv_buf_t bufs[MAX_WRITE_BUFFERS];
+    // the buffers of the pool written, bufs[] may point into them
+    char *frames[MAX_WRITE_BUFFERS];
+};
+
+UvLoop::UvLoop(unsigned int i) : index(i), stopped(false)
 {
-    loop = uv_default_loop();
+    if (index == 0) {
+        loop = uv_default_loop();
+    } else {
+        loop = new uv_loop_t;
+        uv_loop_init(loop);
+    }
     tcp = new uv_tcp_t;
     writeAsync = new uv_async_t;
     stopAsync = new uv_async_t;
+    resumeAsync = new uv_async_t;
+    insertAsync = new uv_async_t;
+    wheelTimer = new uv_timer_t;
 
-    tcp->data = loop->data = stopAsync->data = writeAsync->data = this;
+    tcp->data = loop->data = stopAsync->data = writeAsync->data = resumeAsync->data = this;
+    insertAsync->data = wheelTimer->data = this;
 
     uv_async_init(loop, writeAsync, [](uv_async_t *t) {
-        auto h = reinterpret_cast<UvHandler *>(t->data);
-        h->_WriteToNetwork();
+        auto l = reinterpret_cast<UvLoop *>(t->data);
+        l->_WriteToNetwork();
     });
 
     uv_async_init(loop, stopAsync, [](uv_async_t *async) {
-        UvHandler *h = UvHandler::GetUVHandler();
+        auto l = reinterpret_cast<UvLoop *>(async->data);
+        std::vector<Outgoing> outgoing;
+        l->_mutex.lock();
+        l->stopped = true;
+        outgoing.swap(l->_outgoing);
+        l->_mutex.unlock();
+        // queued before the stop, their connections are closed below
+        for (const auto &o : outgoing) {
+            ReleaseBuffer(o.buf);
+        }
+        l->_InsertDone();
         uv_walk(
-            h->GetLoop(),
-            [](uv_handle_t *h, void *uvh) {
-                void *p = h->data;
-                UvHandler *uvHandler = (UvHandler *)uvh;
-                if (p != nullptr) {
-                    Client *c = uvHandler->RemoveClient((uv_stream_t *)h);
-                    if (c != nullptr) {
-                        c->ReadStop();
-                        c->close();
-                        delete c;
-                    }
+            l->GetLoop(),
+            [](uv_handle_t *h, void *arg) {
+                if (uv_is_closing(h)) {
+                    return;
                 }
-                uv_close((uv_handle_t *)h, nullptr);
+                // connections are deleted once closed, as when the agent closes them
+                auto l = reinterpret_cast<UvLoop *>(arg);
+                bool client = h->type == UV_TCP && h != reinterpret_cast<uv_handle_t *>(l->tcp);
+                uv_close(h, client ? uvCloseCB : nullptr);
             },
-            h);
+            l);
     });
 
-    uv_tcp_init(loop, tcp);
-}
+    uv_async_init(loop, resumeAsync, [](uv_async_t *async) {
+        auto l = reinterpret_cast<UvLoop *>(async->data);
+        l->connections.ForEach([](Client *c) {
+            if (c->readPaused) {
+                c->checkBackpressure();
+            }
+        });
+    });
 
-void UvHandler::DestroyUvHandler()
-{
-    std::lock_guard<std::mutex> lock(_uvMutex);
-    delete server;
-    server = nullptr;
+    uv_async_init(loop, insertAsync, [](uv_async_t *async) {
+        reinterpret_cast<UvLoop *>(async->data)->_InsertDone();
+    });
+
+    // one timer turns the wheel for every connection of the loop
+    wheel.Start(Now());
+    uv_timer_init(loop, wheelTimer);
+    uv_timer_start(
+        wheelTimer,
+        [](uv_timer_t *t) {
+            auto l = reinterpret_cast<UvLoop *>(t->data);
+            l->wheel.Advance(l->Now(), [l](TimerWheel::Entry *e) {
+                l->CheckIdle(reinterpret_cast<Client *>(e->data));
+            });
+        },
+        1000,
+        1000);
+
+    // the socket is created now, so that options can be set on it before bind()
+    uv_tcp_init_ex(loop, tcp, AF_INET);
 }
 
-UvHandler *UvHandler::GetUVHandler()
+UvLoop::~UvLoop()
 {
-    std::lock_guard<std::mutex> lock(_uvMutex);
-    if (server == nullptr) {
-        server = new UvHandler;
+    for (auto r : _freeRequests) {
+        delete r;
     }
-
-    return server;
+    uv_loop_close(loop);
+    if (index != 0) {
+        delete loop;
+    }
+    delete tcp;
+    delete writeAsync;
+    delete stopAsync;
+    delete resumeAsync;
+    delete insertAsync;
+    delete wheelTimer;
 }
 
-void UvHandler::SetupNetwork(const char *addr)
+bool UvLoop::Listen(const sockaddr *addr, bool reusePort)
 {
-    struct sockaddr_in sockAddr;
     int status;
-    status = uv_ip4_addr(addr, DEFAULT_LISTEN_PORT, &sockAddr);
+#ifdef SO_REUSEPORT
+    if (reusePort) {
+        uv_os_fd_t fd;
+        int on = 1;
+        status = uv_fileno(reinterpret_cast<uv_handle_t *>(tcp), &fd);
+        if (status == 0 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) != 0) {
+            status = uv_translate_sys_error(errno);
+        }
+        if (status < 0) {
+            spdlog::error("Startup: loop {} set SO_REUSEPORT failed: {}.",
+                          index,
+                          uv_strerror(status));
+            return false;
+        }
+    }
+#else
+    assert(!reusePort);
+#endif
+
+    status = uv_tcp_bind(tcp, addr, 0);
     if (status < 0) {
-        spdlog::error("Startup: Translate address {} failed.", addr);
-    } else {
-        spdlog::debug("Startup: Translate address {} successfully.", addr);
+        spdlog::error("Startup: loop {} bind failed: {}.", index, uv_strerror(status));
+        return false;
     }
 
-    status = uv_tcp_bind(tcp, (const struct sockaddr *)&sockAddr, 0);
+    status = uv_listen(reinterpret_cast<uv_stream_t *>(tcp), 100, uvConnectCB);
+    if (status) {
+        spdlog::error("Startup: loop {} listen error: {}", index, uv_strerror(status));
+        return false;
+    }
+    return true;
+}
 
-    if (status < 0) {
-        spdlog::error("Startup: bind address {}:{} failed: {}.",
-                      addr,
-                      DEFAULT_LISTEN_PORT,
-                      uv_strerror(status));
+UvLoop::WriteRequest *UvLoop::AcquireWriteRequest()
+{
+    if (_freeRequests.empty()) {
+        return new WriteRequest;
+    }
+    auto r = _freeRequests.back();
+    _freeRequests.pop_back();
+    return r;
+}
+
+void UvLoop::ReleaseWriteRequest(WriteRequest *r)
+{
+    for (unsigned int i = 0; i < r->count; i++) {
+        ReleaseBuffer(r->frames[i]);
+    }
+    r->count = 0;
+    if (_freeRequests.size() < MAX_FREE_WRITE_REQUESTS) {
+        _freeRequests.push_back(r);
     } else {
-        spdlog::debug("Startup: bind address {}:{} successfully.", addr, DEFAULT_LISTEN_PORT);
+        delete r;
     }
+}
 
-    status = uv_listen((uv_stream_t *)tcp, 100, uvConnectCB);
+void UvLoop::Inserted(PendingInsert *i)
+{
+    _mutex.lock();
+    if (stopped) {
+        _mutex.unlock();
+        delete i;
+        return;
+    }
+    _inserted.push_back(i);
+    // under the lock, so the loop cannot close `insertAsync' meanwhile
+    uv_async_send(insertAsync);
+    _mutex.unlock();
+}
 
-    if (status) {
-        spdlog::error("Startup: listen error: {}", uv_strerror(status));
-        exit(1);
-    } else {
-        spdlog::info("Startup: listen successfully.");
+void UvLoop::_InsertDone()
+{
+    std::vector<PendingInsert *> done;
+    _mutex.lock();
+    done.swap(_inserted);
+    _mutex.unlock();
+
+    int64_t events = 0, bytes = 0;
+    for (auto i : done) {
+        auto c = Find(i->id);
+        if (c != nullptr) {
+            c->insertDone(*i);
+        }
+        for (auto p : i->packages) {
+            events += p->size();
+            bytes += p->Bytes();
+        }
+        delete i;
     }
+    UvHandler::GetUVHandler()->AddPending(-events, -bytes);
 }
 
+void UvLoop::WriteToNetwork(ConnectionId id, char *buf, size_t size)
+{
+    if (OnLoopThread()) {
+        auto c = Find(id);
+        if (c != nullptr) {
+            WriteToNetwork(c, buf, size);
+        } else {
+            ReleaseBuffer(buf);
+        }
+        return;
+    }
+    _mutex.lock();
+    if (stopped) {
+        _mutex.unlock();
+        ReleaseBuffer(buf);
+        return;
+    }
+    _outgoing.push_back({id, buf, size});
+    // under the lock, so the loop cannot close `writeAsync' meanwhile
+    uv_async_send(writeAsync);
+    _mutex.unlock();
+}
 
-void UvHandler::ReadFromNetwork(Client *c, char *buf, ssize_t size)
+void UvLoop::WriteToNetwork(Client *c, char *buf, size_t size)
 {
-    c->readFromNetwork(buf, size);
-    delete[] buf;
+    assert(OnLoopThread());
+    size_t offset = 0;
+    if (c->outbound.empty() && !c->writing) {
+        // nothing queued ahead: most replies fit into the socket buffer right away
+        uv_buf_t b = uv_buf_init(buf, static_cast<unsigned int>(size));
+        int n = uv_try_write(*c, &b, 1);
+        if (n == static_cast<int>(size)) {
+            ReleaseBuffer(buf);
+            return;
+        }
+        if (n < 0 && n != UV_EAGAIN) {
+            spdlog::debug("sending package failed: {}", uv_strerror(n));
+            ReleaseBuffer(buf);
+            return;
+        }
+        offset = n > 0 ? n : 0;
+    }
+    c->outbound.push_back({buf, offset, size});
+    Flush(c);
 }
 
-void UvHandler::WriteToNetwork(CoreMessage &msg, uv_stream_t *sock)
+void UvLoop::Flush(Client *c)
 {
-    char *buf;
-    size_t size;
-    msg.toBytes(&buf, &size);
+    if (c->writing || c->outbound.empty()) {
+        return;
+    }
+
+    auto r = AcquireWriteRequest();
+    r->loop = this;
+    r->client = c;
+    r->count = 0;
+    size_t length = 0;
+    while (!c->outbound.empty() && r->count < MAX_WRITE_BUFFERS) {
+        const auto &o = c->outbound.front();
+        r->bufs[r->count] =
+            uv_buf_init(o.buf + o.offset, static_cast<unsigned int>(o.length - o.offset));
+        r->frames[r->count] = o.buf;
+        r->count++;
+        length += o.length - o.offset;
+        c->outbound.pop_front();
+    }
+    r->req.data = r;
+
+    int status = uv_write(&r->req, *c, r->bufs, r->count, [](uv_write_t *req, int status) {
+        auto r = reinterpret_cast<WriteRequest *>(req->data);
+        auto l = r->loop;
+        auto c = r->client;
+        if (status == 0) {
+            spdlog::debug("sending {} packages success.", r->count);
+        }
+        l->ReleaseWriteRequest(r);
+        c->writing = false;
+        // canceled when the connection is closed, which deletes it after this callback
+        if (status == 0) {
+            l->Flush(c);
+        }
+    });
+    if (status < 0) {
+        spdlog::debug("sending {} bytes failed: {}", length, uv_strerror(status));
+        ReleaseWriteRequest(r);
+    } else {
+        c->writing = true;
+    }
+}
 
-    UvHandler::SendObject obj;
-    obj.buf = buf;
-    obj.length = size;
-    obj.sock = sock;
+void UvLoop::ScheduleIdle(Client *c)
+{
+    auto h = UvHandler::GetUVHandler();
+    uint64_t due = c->idleState.Due(h->IdleTimeout(), h->HeartbeatInterval());
+    if (due != UINT64_MAX) {
+        wheel.Schedule(&c->idle, due);
+    }
+}
 
+void UvLoop::CheckIdle(Client *c)
+{
+    if (uv_is_closing(*c)) {
+        return;
+    }
+    auto h = UvHandler::GetUVHandler();
+    uint64_t now = Now();
+    if (c->readPaused) {
+        // not read from, so its silence says nothing about the agent
+        c->idleState.lastActive = now;
+    }
+    switch (c->idleState.Next(now, h->IdleTimeout(), h->HeartbeatInterval())) {
+        case IdleState::Check::close:
+            spdlog::info("Client {} idle for {} seconds, closing.",
+                         c->_client == nullptr ? "(unknown)" : c->_client->_clientName,
+                         now - c->idleState.lastActive);
+            h->CountReaped();
+            c->ReadStop();
+            uv_close(*c, uvCloseCB);
+            return;
+        case IdleState::Check::heartbeat: {
+            HeartbeatPackage hb;
+            c->writeSomething(hb);
+        } break;
+        case IdleState::Check::none:
+            break;
+    }
+    ScheduleIdle(c);
+}
+
+void UvLoop::_WriteToNetwork()
+{
+    std::vector<Outgoing> outgoing;
     _mutex.lock();
-    _sending_queue.emplace(std::move(obj));
+    outgoing.swap(_outgoing);
     _mutex.unlock();
 
-    uv_async_send(writeAsync);
+    for (const auto &o : outgoing) {
+        WriteToNetwork(o.id, o.buf, o.size);
+    }
 }
 
-void UvHandler::_WriteToNetwork()
+void UvLoop::ClientDisconnect(Client *c)
 {
-    _mutex.lock();
+    connections.Remove(c->id);
+    wheel.Cancel(&c->idle);
+}
 
-    while (_sending_queue.size() > 0) {
-        auto front = _sending_queue.front();
 
-        uv_write_t *req = new uv_write_t;
-        uv_buf_t *bufs = new uv_buf_t[1];
+UvHandler *UvHandler::server = nullptr;
 
-        bufs[0].base = front.buf;
-        bufs[0].len = front.length;
+UvHandler::UvHandler() {}
 
-        req->data = bufs;
+void UvHandler::DestroyUvHandler()
+{
+    std::lock_guard<std::mutex> lock(_uvMutex);
+    delete server;
+    server = nullptr;
+}
 
-        uv_write(req, front.sock, bufs, 1, [](uv_write_t *req, int status) {
-            uv_buf_t *bufs = reinterpret_cast<uv_buf_t *>(req->data);
-            if (status == 0) {
-                spdlog::debug("sending package success. length: {}", bufs->len);
-            }
+UvHandler *UvHandler::GetUVHandler()
+{
+    std::lock_guard<std::mutex> lock(_uvMutex);
+    if (server == nullptr) {
+        server = new UvHandler;
+    }
 
-            delete[] bufs->base;
-            delete[] bufs;
-            delete req;
-        });
-        _sending_queue.pop();
+    return server;
+}
+
+void UvHandler::SetupNetwork(const char *addr, unsigned int count)
+{
+    struct sockaddr_in sockAddr;
+    int status;
+    status = uv_ip4_addr(addr, DEFAULT_LISTEN_PORT, &sockAddr);
+    if (status < 0) {
+        spdlog::error("Startup: Translate address {} failed.", addr);
+    } else {
+        spdlog::debug("Startup: Translate address {} successfully.", addr);
     }
 
-    _mutex.unlock();
+    if (count == 0) {
+        count = std::max(1u, std::thread::hardware_concurrency());
+    }
+#ifndef SO_REUSEPORT
+    if (count > 1) {
+        spdlog::warn("Startup: SO_REUSEPORT is not supported, run 1 event loop instead of {}.",
+                     count);
+        count = 1;
+    }
+#endif
+
+    for (unsigned int i = 0; i < count; i++) {
+        auto l = new UvLoop(i);
+        loops.push_back(l);
+        if (!l->Listen(reinterpret_cast<const sockaddr *>(&sockAddr), count > 1)) {
+            spdlog::error("Startup: listen on {}:{} failed.", addr, DEFAULT_LISTEN_PORT);
+            exit(1);
+        }
+    }
+    spdlog::info("Startup: listen on {}:{} successfully with {} event loop{}.",
+                 addr,
+                 DEFAULT_LISTEN_PORT,
+                 count,
+                 count > 1 ? "s" : "");
 }
 
-void UvHandler::ClientDisconnect(Client *c)
+void UvHandler::AddPending(int64_t events, int64_t bytes)
 {
-    _mutex.lock();
+    uint64_t e = pendingEvents.fetch_add(static_cast<uint64_t>(events))
+                 + static_cast<uint64_t>(events);
+    uint64_t b =
+        pendingBytes.fetch_add(static_cast<uint64_t>(bytes)) + static_cast<uint64_t>(bytes);
+    if (!saturated && globalWatermarks.Above(e, b)) {
+        if (!saturated.exchange(true)) {
+            spdlog::warn("Database falls behind: {} events, {} bytes waiting. Pause reading.",
+                         e,
+                         b);
+        }
+    } else if (saturated && globalWatermarks.Below(e, b)) {
+        if (saturated.exchange(false)) {
+            spdlog::info("Database caught up: {} events, {} bytes waiting. Resume reading.", e, b);
+            for (auto l : loops) {
+                l->Resume();
+            }
+        }
+    }
+}
 
-    uv_stream_t *s = *c;
-    const auto &p = _clientMap.find(s);
-    assert(p != _clientMap.cend());
-    _clientMap.erase(p);
+void UvHandler::LogMetrics()
+{
+    size_t clients = 0;
+    for (auto l : loops) {
+        clients += l->ClientCount();
+    }
+    std::ostringstream os;
+    os << GetBufferPoolStatistics();
+    writer->LogMetrics();
+    auto pool = database::Database::GetDatabase()->GetPoolStatistics();
+    spdlog::info("Metrics: database pool of {}: {} open, {} idle; {} checkouts, {} waited, "
+                 "{} us waiting on average",
+                 pool.size,
+                 pool.open,
+                 pool.idle,
+                 pool.checkouts,
+                 pool.waits,
+                 pool.checkouts > 0 ? pool.waitMicros / pool.checkouts : 0);
+    spdlog::info("Metrics: {} connections, {} paused ({} pauses), {} closed idle. Waiting for "
+                 "the database: {} events, {} bytes{}. {}",
+                 clients,
+                 pausedClients.load(),
+                 readPauses.load(),
+                 reaped.load(),
+                 pendingEvents.load(),
+                 pendingBytes.load(),
+                 saturated ? ", above the high watermark" : "",
+                 os.str());
+}
 
-    _mutex.unlock();
+void UvHandler::UvLoopRun()
+{
+    if (metricsInterval > 0) {
+        metricsTimer = new uv_timer_t;
+        metricsTimer->data = this;
+        uv_timer_init(loops[0]->GetLoop(), metricsTimer);
+        uv_timer_start(
+            metricsTimer,
+            [](uv_timer_t *t) { reinterpret_cast<UvHandler *>(t->data)->LogMetrics(); },
+            metricsInterval * 1000,
+            metricsInterval * 1000);
+    }
+    writer->Start(writerThreads);
+    for (size_t i = 1; i < loops.size(); i++) {
+        loops[i]->Start();
+    }
+    loops[0]->Run();
+    for (size_t i = 1; i < loops.size(); i++) {
+        loops[i]->Join();
+    }
+    writer->Stop();
+}
+
+void UvHandler::ReadFromNetwork(Client *c, char *buf, ssize_t size)
+{
+    c->readFromNetwork(buf, size);
 }
 
 void UvHandler::StopLoop()
 {
-    uv_async_send(stopAsync);
+    for (auto l : loops) {
+        l->Stop();
+    }
 }
@@ -0,0 +1,149 @@
+/*
+ *
+ * WangXiao (zjjhwxc@gmail.com)
+ */
+
+#include "clientServer.h"
+
+#include <spdlog/spdlog.h>
+
+using namespace database;
+
+DatabaseWriter::~DatabaseWriter()
+{
+    Stop();
+}
+
+void DatabaseWriter::Start(unsigned int count)
+{
+    for (unsigned int i = 0; i < count; i++) {
+        threads.emplace_back([this]() { Run(); });
+    }
+    spdlog::info("Startup: {} database writer{}, batches of {} events or {} ms",
+                 count,
+                 count > 1 ? "s" : "",
+                 batchEvents,
+                 linger.count());
+}
+
+void DatabaseWriter::Stop()
+{
+    _mutex.lock();
+    _stopping = true;
+    _mutex.unlock();
+    _wake.notify_all();
+    for (auto &t : threads) {
+        t.join();
+    }
+    threads.clear();
+    for (auto i : _queue) {
+        delete i;
+    }
+    _queue.clear();
+    _queuedEvents = 0;
+}
+
+void DatabaseWriter::Submit(PendingInsert *i)
+{
+    i->queued = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(_mutex);
+    bool wake = _queue.empty() || (_queuedEvents < batchEvents
+                                   && _queuedEvents + i->events >= batchEvents);
+    _queue.push_back(i);
+    _queuedEvents += i->events;
+    lock.unlock();
+    // a writer starts lingering on the first package, and stops on a full batch
+    if (wake) {
+        _wake.notify_one();
+    }
+}
+
+void DatabaseWriter::Run()
+{
+    std::vector<PendingInsert *> batch;
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_stopping) {
+        if (_queue.empty()) {
+            _wake.wait(lock);
+            continue;
+        }
+        auto due = _queue.front()->queued + linger;
+        if (_queuedEvents < batchEvents && std::chrono::steady_clock::now() < due) {
+            _wake.wait_until(lock, due);
+            continue;
+        }
+        // the packages of one connection are never split over batches, a batch larger than
+        // `batchEvents' holds one connection's only
+        size_t events = 0;
+        do {
+            events += _queue.front()->events;
+            batch.push_back(_queue.front());
+            _queue.pop_front();
+        } while (!_queue.empty() && events + _queue.front()->events <= batchEvents);
+        _queuedEvents -= events;
+        // others may be ready for another writer
+        if (!_queue.empty()) {
+            _wake.notify_one();
+        }
+
+        lock.unlock();
+        Write(batch);
+        batch.clear();
+        lock.lock();
+    }
+}
+
+void DatabaseWriter::Write(std::vector<PendingInsert *> &batch)
+{
+    auto db = Database::GetDatabase();
+    Database::EventBatch events;
+    size_t count = 0;
+    for (auto i : batch) {
+        for (auto p : i->packages) {
+            events.emplace_back(i->client, p);
+        }
+        count += i->events;
+    }
+
+    if (db->InsertWindowsEvents(events)) {
+        commits++;
+        committedPackages += events.size();
+        committedEvents += count;
+        for (auto i : batch) {
+            i->stored = true;
+        }
+    } else {
+        failures++;
+        // so that the events of one agent the database rejects do not refuse the others
+        if (batch.size() > 1) {
+            for (auto i : batch) {
+                events.clear();
+                for (auto p : i->packages) {
+                    events.emplace_back(i->client, p);
+                }
+                i->stored = db->InsertWindowsEvents(events);
+                if (i->stored) {
+                    commits++;
+                    committedPackages += events.size();
+                    committedEvents += i->events;
+                }
+            }
+        }
+    }
+
+    for (auto i : batch) {
+        i->loop->Inserted(i);
+    }
+}
+
+void DatabaseWriter::LogMetrics()
+{
+    uint64_t c = commits;
+    spdlog::info("Metrics: database writer: {} commits of {} packages, {} events ({} events "
+                 "per commit), {} batches failed",
+                 c,
+                 committedPackages.load(),
+                 committedEvents.load(),
+                 c > 0 ? committedEvents / c : 0,
+                 failures.load());
+}
@@ -0,0 +1,106 @@
+/*
+ * dictTrainer: builds a shared compression dictionary from captured agent traffic.
+ *
+ *     dictTrainer <id> <output.dict> <capture>...
+ *
+ * Every capture holds the raw byte stream one agent sent to the server, e.g. one side of a
+ * TCP stream exported with tcpflow. Each Windows event found in it is one training sample.
+ * Load the output on the server ("compression": { "dictionary": "<output.dict>" }) and next to
+ * the agent under the same id.
+ */
+
+#include "protobufLib.h"
+
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+#include <zdict.h>
+
+using namespace protobuf;
+
+namespace
+{
+    // zstd's recommended dictionary size
+    constexpr size_t DICTIONARY_SIZE = 110 * 1024;
+
+    size_t readCapture(const char* path, std::string& samples, std::vector<size_t>& sizes)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            std::cerr << "cannot open " << path << std::endl;
+            return 0;
+        }
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+        ProtobufPacketDecoder decoder;
+        decoder.DecodeLogPackageViews(true);
+        decoder.read(data.data(), data.size());
+
+        size_t events = 0;
+        CoreMessage* msg;
+        while ((msg = decoder.GetProtobufMessage()) != nullptr) {
+            if (auto lp = dynamic_cast<LogPackageView*>(msg)) {
+                for (const auto& e : *lp) {
+                    auto before = samples.size();
+                    samples += e.xml;
+                    samples += e.format;
+                    samples += e.provider;
+                    sizes.push_back(samples.size() - before);
+                    events++;
+                }
+            }
+            delete msg;
+        }
+        return events;
+    }
+}  // namespace
+
+int main(int argc, const char* argv[])
+{
+    if (argc < 4) {
+        std::cerr << "usage: " << argv[0] << " <id> <output.dict> <capture>..." << std::endl;
+        return 1;
+    }
+
+    int id = atoi(argv[1]);
+    if (id <= 0 || id > 255) {
+        std::cerr << "dictionary id must be in 1-255" << std::endl;
+        return 1;
+    }
+
+    initProtobufLibrary();
+
+    std::string samples;
+    std::vector<size_t> sizes;
+    for (int i = 3; i < argc; i++) {
+        auto events = readCapture(argv[i], samples, sizes);
+        std::cout << argv[i] << ": " << events << " events" << std::endl;
+    }
+
+    if (sizes.empty()) {
+        std::cerr << "no events found" << std::endl;
+        return 1;
+    }
+
+    std::vector<char> dict(DICTIONARY_SIZE);
+    auto size = ZDICT_trainFromBuffer(dict.data(),
+                                      dict.size(),
+                                      samples.data(),
+                                      sizes.data(),
+                                      static_cast<unsigned>(sizes.size()));
+    if (ZDICT_isError(size)) {
+        std::cerr << "training failed: " << ZDICT_getErrorName(size) << std::endl;
+        return 1;
+    }
+
+    if (!SaveDictionaryFile(argv[2], static_cast<uint8_t>(id), dict.data(), size)) {
+        std::cerr << "cannot write " << argv[2] << std::endl;
+        return 1;
+    }
+    std::cout << "dictionary " << id << ": " << size << " bytes from " << sizes.size()
+              << " samples written to " << argv[2] << std::endl;
+
+    shutdownProtobufLibrary();
+    return 0;
+}
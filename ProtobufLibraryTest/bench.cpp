@@ -0,0 +1,269 @@
+//
+// bench.cpp
+// protoBench: Google Benchmark suite of WindowsProtobufLib. Every benchmark reports the
+// number of heap allocations per event next to its time, buffers the pool had to allocate
+// included, and the hit rate of the buffer pool.
+//
+// Encoding and decoding run over packages of 1 to 1000 events and every compression setting
+// compiled in; decoding also over reads of 1 byte, of one Ethernet MTU and of whole frames.
+// `--benchmark_out=<file> --benchmark_out_format=json' (or the protoBenchJson target) keeps the
+// results for comparing releases with Google Benchmark's tools/compare.py.
+//
+
+#include "generator.h"
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <iterator>
+#include <new>
+
+using namespace protobuf;
+
+namespace
+{
+    std::atomic<uint64_t> allocations{0};
+
+    // the compression settings benchmarked, picked by index
+    const FrameOption settings[] = {
+        FrameOption(Codec::none, 0),
+        FrameOption(Codec::zlib, 1),
+        FrameOption(Codec::zlib, FrameOption::DEFAULT_ZLIB_LEVEL),
+        FrameOption(Codec::lz4, 0),
+        FrameOption(Codec::zstd, 3),
+    };
+
+    const int64_t eventCounts[] = {1, 10, 100, 1000};
+
+    // bytes handed to each read(): one, a TCP segment of an Ethernet MTU, or the whole frame
+    const int64_t fragments[] = {1, 1460, 0};
+
+    // the setting at `index', or false, marking the benchmark skipped, if its codec is not
+    // compiled in
+    bool frameOption(benchmark::State& state, int64_t index, FrameOption& option)
+    {
+        option = settings[index];
+        if ((SupportedCodecs() & (1u << static_cast<int>(option.codec))) == 0) {
+            state.SkipWithError("codec not compiled in");
+            return false;
+        }
+        state.SetLabel(std::string(CodecName(option.codec)) + "/"
+                       + std::to_string(option.level));
+        return true;
+    }
+
+    void encodeMatrix(benchmark::internal::Benchmark* b)
+    {
+        b->ArgNames({"events", "codec"});
+        for (auto events : eventCounts) {
+            for (int64_t s = 0; s < static_cast<int64_t>(std::size(settings)); s++) {
+                b->Args({events, s});
+            }
+        }
+    }
+
+    void decodeMatrix(benchmark::internal::Benchmark* b)
+    {
+        b->ArgNames({"events", "read", "codec"});
+        for (auto events : eventCounts) {
+            for (auto fragment : fragments) {
+                for (int64_t s = 0; s < static_cast<int64_t>(std::size(settings)); s++) {
+                    b->Args({events, fragment, s});
+                }
+            }
+        }
+    }
+
+    // the serialized coreMessage of a package with `events' events, as found in a frame
+    std::string serializedPackage(uint32_t events)
+    {
+        auto p = buildLargePackage(events);
+        char* buf;
+        size_t s;
+        p->toBytes(&buf, &s, FrameOption(Codec::none, 0));
+        size_t header = PACKAGE_FIXED_HEADER_SIZE + DigestSize(Checksum::crc32c);
+        std::string ret(buf + header, s - header);
+        ReleaseBuffer(buf);
+        delete p;
+        return ret;
+    }
+
+    // operator new calls and buffers allocated by the pool
+    uint64_t allocationCount()
+    {
+        return allocations + GetBufferPoolStatistics().misses;
+    }
+
+    void countAllocations(benchmark::State& state, uint64_t before, uint32_t events)
+    {
+        state.SetItemsProcessed(state.iterations() * events);
+        state.counters["allocs/event"] =
+            static_cast<double>(allocationCount() - before) / (state.iterations() * events);
+        state.counters["pool_hit_rate"] = GetBufferPoolStatistics().HitRate();
+    }
+}  // namespace
+
+void* operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+static void BM_ToBytes(benchmark::State& state)
+{
+    auto events = static_cast<uint32_t>(state.range(0));
+    FrameOption option;
+    if (!frameOption(state, state.range(1), option)) {
+        return;
+    }
+    auto p = buildLargePackage(events);
+
+    size_t bytes = 0;
+    uint64_t before = allocationCount();
+    for (auto _ : state) {
+        char* buf;
+        size_t s;
+        p->toBytes(&buf, &s, option);
+        bytes += s;
+        ReleaseBuffer(buf);
+    }
+    countAllocations(state, before, events);
+    state.SetBytesProcessed(bytes);
+    delete p;
+}
+BENCHMARK(BM_ToBytes)->Apply(encodeMatrix);
+
+// frames arriving in pieces of range(1) bytes (0 for whole frames) through the decoder
+static void BM_Read(benchmark::State& state)
+{
+    auto events = static_cast<uint32_t>(state.range(0));
+    auto fragment = static_cast<size_t>(state.range(1));
+    FrameOption option;
+    if (!frameOption(state, state.range(2), option)) {
+        return;
+    }
+    auto p = buildLargePackage(events);
+    char* buf;
+    size_t s;
+    p->toBytes(&buf, &s, option);
+    if (fragment == 0) {
+        fragment = s;
+    }
+
+    ProtobufPacketDecoder decoder;
+    uint64_t before = allocationCount();
+    for (auto _ : state) {
+        for (size_t off = 0; off < s; off += fragment) {
+            decoder.read(buf + off, std::min(fragment, s - off));
+        }
+        delete decoder.GetProtobufMessage();
+    }
+    countAllocations(state, before, events);
+    state.SetBytesProcessed(state.iterations() * s);
+
+    ReleaseBuffer(buf);
+    delete p;
+}
+BENCHMARK(BM_Read)->Apply(decodeMatrix);
+
+// parsing as BuildObj() did before: a heap coreMessage, every string copied into the events
+static void BM_BuildObjCopy(benchmark::State& state)
+{
+    auto events = static_cast<uint32_t>(state.range(0));
+    auto data = serializedPackage(events);
+
+    uint64_t before = allocationCount();
+    for (auto _ : state) {
+        coreMessage core;
+        core.ParseFromArray(data.data(), data.size());
+        auto lp = new LogPackage(core.logneedaccept());
+        lp->reserve(core.log_size());
+        for (const auto& l : core.log()) {
+            lp->AddLogEvent(Event(l.xmleventmessage(),
+                                  l.raweventmessage(),
+                                  l.scope(),
+                                  l.timestamp(),
+                                  l.level(),
+                                  l.recordid()));
+        }
+        lp->Description(std::string(core.description()));
+        benchmark::DoNotOptimize(lp);
+        delete lp;
+    }
+    countAllocations(state, before, events);
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_BuildObjCopy)->Arg(1)->Arg(10)->Arg(100)->Arg(1000);
+
+// parsing on the per-thread arena, strings moved out of the message
+static void BM_ParseFromArray(benchmark::State& state)
+{
+    auto events = static_cast<uint32_t>(state.range(0));
+    auto data = serializedPackage(events);
+
+    uint64_t before = allocationCount();
+    for (auto _ : state) {
+        auto msg = CoreMessage::parseFromArray(data.data(), data.size());
+        benchmark::DoNotOptimize(msg);
+        delete msg;
+    }
+    countAllocations(state, before, events);
+    state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_ParseFromArray)->Arg(1)->Arg(10)->Arg(100)->Arg(1000);
+
+// whole frames into a LogPackageView, the events read in place
+static void BM_DecodeView(benchmark::State& state)
+{
+    auto events = static_cast<uint32_t>(state.range(0));
+    auto p = buildLargePackage(events);
+    char* buf;
+    size_t s;
+    p->toBytes(&buf, &s, FrameOption(Codec::none, 0));
+
+    ProtobufPacketDecoder decoder;
+    decoder.DecodeLogPackageViews(true);
+    uint64_t before = allocationCount();
+    for (auto _ : state) {
+        decoder.read(buf, s);
+        auto view = dynamic_cast<LogPackageView*>(decoder.GetProtobufMessage());
+        size_t bytes = 0;
+        for (const auto& e : *view) {
+            bytes += e.xml.size() + e.format.size();
+        }
+        benchmark::DoNotOptimize(bytes);
+        delete view;
+    }
+    countAllocations(state, before, events);
+    state.SetBytesProcessed(state.iterations() * s);
+
+    ReleaseBuffer(buf);
+    delete p;
+}
+BENCHMARK(BM_DecodeView)->Arg(1)->Arg(10)->Arg(100)->Arg(1000);
+
+int main(int argc, char** argv)
+{
+    initProtobufLibrary();
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    shutdownProtobufLibrary();
+    return 0;
+}
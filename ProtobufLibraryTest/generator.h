@@ -0,0 +1,66 @@
+//
+// generator.h
+// Random packages shared by the tests and the benchmarks.
+//
+
+#pragma once
+
+#include <random>
+#include <string>
+
+#include "protobufLib.h"
+
+using CH = char;
+
+inline unsigned int random_value()
+{
+    static std::random_device rd;
+    return rd();
+}
+
+inline const CH *random_string(int len = 20)
+{
+    size_t actual_size;
+    if (len <= 0) {
+        actual_size = 10 + random_value() % 10;
+    } else {
+        actual_size = static_cast<size_t>(len);
+    }
+    CH *buffer = new CH[actual_size + 1];
+    for (size_t t = 0; t < actual_size; t++) {
+        buffer[t] = random_value() % ('z' - 'a') + 'a';
+    }
+    buffer[actual_size] = '\0';
+    return buffer;
+}
+
+// a LogPackage of `evts' random events, 50 to 99 if 0
+inline protobuf::CoreMessage *buildLargePackage(uint32_t evts = 0)
+{
+    if (evts == 0) {
+        evts = random_value() % 50 + 50;
+    }
+    protobuf::LogPackage *lp = new protobuf::LogPackage;
+    const CH *p;
+    lp->Description(std::string(p = random_string()));
+    for (uint32_t i = 0; i < evts; i++) {
+        auto xml = random_string();
+        auto msg = random_string(50);
+        auto times = random_string(10);
+        auto f = random_string(20);
+        protobuf::Event e(std::string(xml),
+                          std::string(msg),
+                          std::string(times),
+                          std::string(f),
+                          random_value() % 5,
+                          random_value());
+
+        lp->AddLogEvent(std::move(e));
+        delete[] xml;
+        delete[] msg;
+        delete[] times;
+        delete[] f;
+    }
+    delete[] p;
+    return lp;
+}
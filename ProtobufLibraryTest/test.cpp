@@ -1,6 +1,9 @@
 #include "pch.h"
+#include "generator.h"
 
+#include <chrono>
 #include <string>
+#include <thread>
 
 #if defined WINDOWS || defined _WINDOWS_
 #pragma comment(lib, "WindowsProtobufLib.lib")
@@ -9,30 +12,6 @@
 
 using namespace protobuf;
 
-using CH = char;
-
-unsigned int random_value()
-{
-    static std::random_device rd;
-    return rd();
-}
-
-const CH *random_string(int len = 20)
-{
-    size_t actual_size;
-    if (len <= 0) {
-        actual_size = 10 + random_value() % 10;
-    } else {
-        actual_size = static_cast<size_t>(len);
-    }
-    CH *buffer = new CH[actual_size + 1];
-    for (size_t t = 0; t < actual_size; t++) {
-        buffer[t] = random_value() % ('z' - 'a') + 'a';
-    }
-    buffer[actual_size] = '\0';
-    return buffer;
-}
-
 TEST(protobufLib, encode1)
 {
     LogPackage l;
@@ -45,35 +24,7 @@ TEST(protobufLib, encode1)
     EXPECT_TRUE(decoder.GetSize() == 1);
 
     decoder.Reset();
-    delete[] buf;
-}
-
-CoreMessage *buildLargePackage()
-{
-    auto evts = random_value() % 50 + 50;
-    LogPackage *lp = new LogPackage;
-    const CH *p;
-    lp->Description(std::string(p = random_string()));
-    for (uint32_t i = 0; i < evts; i++) {
-        auto xml = random_string();
-        auto msg = random_string(50);
-        auto times = random_string(10);
-        auto f = random_string(20);
-        Event e(std::string(xml),
-                std::string(msg),
-                std::string(times),
-                std::string(f),
-                random_value() % 5,
-                random_value());
-
-        lp->AddLogEvent(std::move(e));
-        delete[] xml;
-        delete[] msg;
-        delete[] times;
-        delete[] f;
-    }
-    delete[] p;
-    return lp;
+    ReleaseBuffer(buf);
 }
 
 TEST(protobufLib, encode2)
@@ -92,7 +43,7 @@ TEST(protobufLib, encode2)
     EXPECT_TRUE(decoder.GetSize() == 1);
 
     decoder.Reset();
-    delete[] buf;
+    ReleaseBuffer(buf);
 }
 
 
@@ -116,7 +67,7 @@ TEST(protobufLib, encode3)
 
     ProtobufPacketDecoder decoder;
 
-    decoder.read(buf3, s3);
+    EXPECT_EQ(decoder.read(buf3, s3), 2u);
     EXPECT_EQ(decoder.GetSize(), 2);
     decoder.Reset();
 
@@ -124,8 +75,8 @@ TEST(protobufLib, encode3)
 
     int offset = rd() % (s3);
 
-    decoder.read(buf3, offset);
-    decoder.read(buf3 + offset, s3 - offset);
+    auto first = decoder.read(buf3, offset);
+    EXPECT_EQ(first + decoder.read(buf3 + offset, s3 - offset), 2u);
 
     EXPECT_TRUE(decoder.GetSize() == 2);
 
@@ -136,8 +87,8 @@ TEST(protobufLib, encode3)
 
     EXPECT_TRUE(decoder.GetSize() == 2);
 
-    delete[] buf1;
-    delete[] buf2;
+    ReleaseBuffer(buf1);
+    ReleaseBuffer(buf2);
     delete[] buf3;
 
     delete p;
@@ -146,7 +97,719 @@ TEST(protobufLib, encode3)
     decoder.Reset();
 }
 
+TEST(protobufLib, roundTrip)
+{
+    auto *p = dynamic_cast<LogPackage *>(buildLargePackage());
+    char *buf;
+    size_t s;
+    EXPECT_TRUE(p->toBytes(&buf, &s));
+
+    ProtobufPacketDecoder decoder;
+    decoder.read(buf, s);
+    auto *r = dynamic_cast<LogPackage *>(decoder.GetProtobufMessage());
+    ASSERT_TRUE(r != nullptr);
+
+    const auto &src = p->GetEvents();
+    const auto &dst = r->GetEvents();
+    ASSERT_EQ(src.size(), dst.size());
+    for (size_t i = 0; i < src.size(); i++) {
+        EXPECT_EQ(src[i].xml, dst[i].xml);
+        EXPECT_EQ(src[i].format, dst[i].format);
+        EXPECT_EQ(src[i].provider, dst[i].provider);
+        EXPECT_EQ(src[i].timeStamp, dst[i].timeStamp);
+        EXPECT_EQ(src[i].rid, dst[i].rid);
+    }
+
+    ReleaseBuffer(buf);
+    delete p;
+    delete r;
+}
+
+TEST(protobufLib, buildObj)
+{
+    coreMessage core;
+    core.set_op(coreMessage_Operation_UPDATE_LOG);
+    core.set_description(std::string(40, 'd'));
+    core.add_log()->set_xmleventmessage(std::string(100, 'x'));
+
+    // the const overload copies, the rvalue one takes the strings
+    auto *copied = dynamic_cast<LogPackage *>(CoreMessage::BuildObj(core));
+    ASSERT_TRUE(copied != nullptr);
+    EXPECT_EQ(core.log(0).xmleventmessage(), copied->GetEvents()[0].xml);
+
+    auto *moved = dynamic_cast<LogPackage *>(CoreMessage::BuildObj(std::move(core)));
+    ASSERT_TRUE(moved != nullptr);
+    EXPECT_EQ(moved->GetEvents()[0].xml, std::string(100, 'x'));
+    EXPECT_EQ(moved->Description(), copied->Description());
+
+    delete copied;
+    delete moved;
+}
+
+TEST(protobufLib, logPackageView)
+{
+    auto *p = dynamic_cast<LogPackage *>(buildLargePackage());
+    p->AddLogEvent(Event("", "", "", "", 0u, 0));
+    char *buf;
+    size_t s;
+    EXPECT_TRUE(p->toBytes(&buf, &s));
+
+    // the view holds what the usual decoding into a LogPackage holds
+    ProtobufPacketDecoder plain;
+    plain.read(buf, s);
+    auto *l = dynamic_cast<LogPackage *>(plain.GetProtobufMessage());
+    ASSERT_TRUE(l != nullptr);
+
+    ProtobufPacketDecoder decoder;
+    decoder.DecodeLogPackageViews(true);
+    EXPECT_EQ(decoder.read(buf, s), 1u);
+    auto *v = dynamic_cast<LogPackageView *>(decoder.GetProtobufMessage());
+    ASSERT_TRUE(v != nullptr);
+    EXPECT_EQ(v->Op(), Operation::UPDATE_LOG);
+    EXPECT_EQ(v->Description(), l->Description());
+    EXPECT_EQ(v->GetClientName(), CoreMessage::getClientName());
+    EXPECT_EQ(v->NeedAccept(), l->NeedAccept());
+
+    const auto &src = l->GetEvents();
+    ASSERT_EQ(v->size(), src.size());
+    size_t i = 0;
+    for (const auto &e : *v) {
+        ASSERT_LT(i, src.size());
+        EXPECT_EQ(e.xml, src[i].xml);
+        EXPECT_EQ(e.format, src[i].format);
+        EXPECT_EQ(e.provider, src[i].provider);
+        EXPECT_EQ(e.timeStamp, src[i].timeStamp);
+        EXPECT_EQ(e.level, src[i].level);
+        EXPECT_EQ(e.rid, src[i].rid);
+        i++;
+    }
+    EXPECT_EQ(i, src.size());
+    EXPECT_EQ(v->back().xml, src.back().xml);
+
+    // a view serializes back to the same events
+    char *again;
+    size_t againSize;
+    EXPECT_TRUE(v->toBytes(&again, &againSize));
+    plain.read(again, againSize);
+    auto *r = dynamic_cast<LogPackage *>(plain.GetProtobufMessage());
+    ASSERT_TRUE(r != nullptr);
+    ASSERT_EQ(r->GetEvents().size(), src.size());
+    EXPECT_EQ(r->GetEvents()[3].format, src[3].format);
+
+    // other messages still decode to their own classes
+    ConnectPackage cp;
+    char *cbuf;
+    size_t cs;
+    cp.toBytes(&cbuf, &cs);
+    decoder.read(cbuf, cs);
+    auto *c = dynamic_cast<ConnectPackage *>(decoder.GetProtobufMessage());
+    EXPECT_TRUE(c != nullptr);
+
+    ReleaseBuffer(buf);
+    ReleaseBuffer(again);
+    ReleaseBuffer(cbuf);
+    delete p;
+    delete l;
+    delete v;
+    delete r;
+    delete c;
+}
+
+TEST(protobufLib, codecs)
+{
+    const int levels[CODEC_COUNT] = {0, 1, 0, 3};
+
+    for (int i = 0; i < CODEC_COUNT; i++) {
+        auto codec = static_cast<Codec>(i);
+        if ((SupportedCodecs() & (1u << i)) == 0) {
+            continue;
+        }
+        CoreMessage *p = buildLargePackage();
+        FrameStatistics stats;
+        char *buf;
+        size_t s;
+        EXPECT_TRUE(p->toBytes(&buf, &s, FrameOption(codec, levels[i]), &stats));
+        EXPECT_EQ(stats.SentFrames(codec), 1u);
+
+        ProtobufPacketDecoder decoder;
+        decoder.SetStatistics(&stats);
+        EXPECT_EQ(decoder.read(buf, s), 1u);
+        EXPECT_EQ(stats.ReceivedFrames(codec), 1u);
+
+        ReleaseBuffer(buf);
+        delete p;
+
+        EXPECT_TRUE(CodecLevelValid(codec, levels[i]));
+        EXPECT_TRUE(CodecLevelValid(codec, FrameOption().level));
+        if (codec != Codec::none) {
+            EXPECT_FALSE(CodecLevelValid(codec, 1000));
+        }
+    }
+    EXPECT_FALSE(CodecLevelValid(Codec::zlib, 10));
+    EXPECT_FALSE(CodecLevelValid(Codec::zlib, -2));
+}
+
+TEST(protobufLib, negotiate)
+{
+    ConnectPackage agent;
+    char *buf;
+    size_t s;
+    agent.toBytes(&buf, &s);
+
+    ProtobufPacketDecoder decoder;
+    decoder.read(buf, s);
+    auto *cp = dynamic_cast<ConnectPackage *>(decoder.GetProtobufMessage());
+    ASSERT_TRUE(cp != nullptr);
+    EXPECT_EQ(cp->Codecs(), SupportedCodecs());
+
+    auto option = cp->Negotiate(FrameOption(Codec::none, 0));
+    EXPECT_EQ(option.codec, Codec::none);
+
+    option = cp->Negotiate(FrameOption(static_cast<Codec>(CODEC_COUNT - 1), 1));
+    EXPECT_TRUE(SupportedCodecs() & (1u << static_cast<int>(option.codec)));
+
+    ReleaseBuffer(buf);
+    delete cp;
+}
+
+TEST(protobufLib, session)
+{
+    // the server assigns a session to an agent that understands them
+    ConnectPackage agent;
+    EXPECT_TRUE(agent.Sessions());
+    FrameOption preferred;
+    preferred.session = 42;
+    auto option = agent.Negotiate(preferred);
+    EXPECT_EQ(option.session, 42u);
+
+    ConnectPackage reply(option);
+    char *buf;
+    size_t s;
+    reply.toBytes(&buf, &s, option);
+    ProtobufPacketDecoder decoder;
+    decoder.read(buf, s);
+    auto *cp = dynamic_cast<ConnectPackage *>(decoder.GetProtobufMessage());
+    ASSERT_TRUE(cp != nullptr);
+    EXPECT_EQ(cp->GetFrameOption().session, 42u);
+    EXPECT_EQ(cp->GetClientName(), CoreMessage::getClientName());
+    ReleaseBuffer(buf);
+    delete cp;
+
+    // later frames carry the id instead of the identity
+    QueryLastEventPackage q;
+    char *full, *brief;
+    size_t fullSize, briefSize;
+    q.toBytes(&full, &fullSize, FrameOption(Codec::none, 0));
+    q.toBytes(&brief, &briefSize, option);
+    EXPECT_LT(briefSize, fullSize);
+
+    decoder.read(brief, briefSize);
+    auto *r = decoder.GetProtobufMessage();
+    ASSERT_TRUE(r != nullptr);
+    EXPECT_EQ(r->Op(), Operation::QUERY_LAST_EVENT);
+    EXPECT_EQ(r->Session(), 42u);
+    EXPECT_TRUE(r->GetClientName().empty());
+    EXPECT_TRUE(r->TimeStamp().empty());
+    delete r;
+
+    LogPackage l;
+    l.AddLogEvent(Event("xml", "format", "provider", "2020-01-01 00:00:00", 1u, 7));
+    l.toBytes(&buf, &s, option);
+    decoder.DecodeLogPackageViews(true);
+    decoder.read(buf, s);
+    auto *v = dynamic_cast<LogPackageView *>(decoder.GetProtobufMessage());
+    ASSERT_TRUE(v != nullptr);
+    EXPECT_EQ(v->Session(), 42u);
+    EXPECT_EQ(v->back().rid, 7u);
+    ReleaseBuffer(buf);
+    delete v;
+
+    ReleaseBuffer(full);
+    ReleaseBuffer(brief);
+}
+
+TEST(protobufLib, batch)
+{
+    QueryLastEventPackage q;
+    AcceptLastEventPackage a(5);
+    auto *l = buildLargePackage(40);
+    ReturnLastEventPackage r(9);
+    std::vector<CoreMessage *> msgs = {&q, &a, l, &r};
+
+    ConnectPackage agent;
+    FrameOption preferred;
+    preferred.batch = true;
+    auto option = agent.Negotiate(preferred);
+    EXPECT_TRUE(option.batch);
+
+    for (bool batch : {true, false}) {
+        option.batch = batch;
+        FrameStatistics stats;
+        char *buf;
+        size_t s;
+        EXPECT_TRUE(ProtobufPacketDecoder::ProtobufPacketEncoder(&buf, s, msgs, option, &stats));
+        uint64_t frames = 0;
+        for (int i = 0; i < CODEC_COUNT; i++) {
+            frames += stats.SentFrames(static_cast<Codec>(i));
+        }
+        EXPECT_EQ(frames, batch ? 1u : msgs.size());
+
+        for (bool views : {false, true}) {
+            ProtobufPacketDecoder decoder;
+            decoder.DecodeLogPackageViews(views);
+            size_t received = 0;
+            for (size_t i = 0; i < s; i++) {
+                received += decoder.read(buf + i, 1);
+            }
+            ASSERT_EQ(received, msgs.size());
+
+            auto *m = decoder.GetProtobufMessage();
+            EXPECT_EQ(m->Op(), Operation::QUERY_LAST_EVENT);
+            delete m;
+            m = decoder.GetProtobufMessage();
+            auto *accept = dynamic_cast<AcceptLastEventPackage *>(m);
+            ASSERT_TRUE(accept != nullptr);
+            EXPECT_EQ(accept->GetLastEventID(), 5u);
+            delete m;
+            m = decoder.GetProtobufMessage();
+            if (views) {
+                auto *v = dynamic_cast<LogPackageView *>(m);
+                ASSERT_TRUE(v != nullptr);
+                EXPECT_EQ(v->size(), 40u);
+            } else {
+                auto *lp = dynamic_cast<LogPackage *>(m);
+                ASSERT_TRUE(lp != nullptr);
+                EXPECT_EQ(lp->GetEvents().size(), 40u);
+            }
+            delete m;
+            m = decoder.GetProtobufMessage();
+            auto *ret = dynamic_cast<ReturnLastEventPackage *>(m);
+            ASSERT_TRUE(ret != nullptr);
+            EXPECT_EQ(ret->GetLastEventID(), 9u);
+            delete m;
+        }
+        ReleaseBuffer(buf);
+    }
+    delete l;
+}
+
+TEST(protobufLib, crc32c)
+{
+    const char check[] = "123456789";
+    EXPECT_EQ(Crc32c(check, 9), 0xE3069283u);
+
+    // running checksum over arbitrary splits
+    auto *str = random_string(1000);
+    auto whole = Crc32c(str, 1000);
+    for (size_t split : {0, 1, 7, 8, 9, 500, 999, 1000}) {
+        EXPECT_EQ(Crc32c(str + split, 1000 - split, Crc32c(str, split)), whole);
+    }
+    delete[] str;
+}
+
+TEST(protobufLib, checksums)
+{
+    for (int i = 0; i < CHECKSUM_COUNT; i++) {
+        auto checksum = static_cast<Checksum>(i);
+        if ((SupportedChecksums() & (1u << i)) == 0) {
+            continue;
+        }
+        CoreMessage *p = buildLargePackage();
+        char *buf;
+        size_t s;
+        EXPECT_TRUE(p->toBytes(&buf, &s, FrameOption(Codec::zlib, 1, checksum)));
+
+        ProtobufPacketDecoder decoder;
+        for (size_t j = 0; j < s; j++) {
+            decoder.read(buf + j, 1);
+        }
+        EXPECT_EQ(decoder.GetSize(), 1u);
+
+        ReleaseBuffer(buf);
+        delete p;
+    }
+}
+
 #if !defined _WIN32 || !defined _WIN64
+TEST(protobufLib, streaming)
+{
+    // a frame far larger than a receive chunk and an inflate block, arriving in uneven pieces
+    const int levels[CODEC_COUNT] = {0, 1, 0, 3};
+    LogPackage p;
+    for (int i = 0; i < 2000; i++) {
+        auto xml = random_string(60);
+        p.AddLogEvent(Event(xml, "message", "provider", "2020-01-01 00:00:00", 1u, i));
+        delete[] xml;
+    }
+
+    for (int i = 0; i < CODEC_COUNT; i++) {
+        auto codec = static_cast<Codec>(i);
+        if ((SupportedCodecs() & (1u << i)) == 0) {
+            continue;
+        }
+        char *buf;
+        size_t s;
+        EXPECT_TRUE(p.toBytes(&buf, &s, FrameOption(codec, levels[i])));
+        EXPECT_GT(s, ChunkChain::CHUNK_SIZE * 2);
+
+        ProtobufPacketDecoder decoder;
+        size_t received = 0;
+        for (size_t off = 0; off < s; off += 4099) {
+            received += decoder.read(buf + off, std::min<size_t>(4099, s - off));
+        }
+        EXPECT_EQ(received, 1u);
+
+        auto *r = dynamic_cast<LogPackage *>(decoder.GetProtobufMessage());
+        ASSERT_TRUE(r != nullptr);
+        ASSERT_EQ(r->GetEvents().size(), p.GetEvents().size());
+        EXPECT_EQ(r->GetEvents().back().xml, p.GetEvents().back().xml);
+
+        ReleaseBuffer(buf);
+        delete r;
+    }
+}
+
+TEST(protobufLib, decodeErrors)
+{
+    LogPackage p;
+    p.AddLogEvent(Event("xml", "message", "provider", "2020-01-01 00:00:00", 1u, 1u));
+    char *buf;
+    size_t s;
+    p.toBytes(&buf, &s, FrameOption(Codec::none, 0));
+
+    // a corrupt frame is dropped and counted, the frames after it still decode
+    ProtobufPacketDecoder decoder;
+    std::string corrupt(buf, s);
+    corrupt[s - 1] ^= 0x5a;
+    EXPECT_EQ(decoder.read(corrupt.data(), corrupt.size()), 0u);
+    EXPECT_EQ(decoder.Errors(), 1u);
+    EXPECT_EQ(decoder.read(buf, s), 1u);
+    delete decoder.GetProtobufMessage();
+
+    // so is a frame in a codec this side does not know
+    std::string unknown(buf, s);
+    unknown[11] = static_cast<char>(0xff);
+    EXPECT_EQ(decoder.read(unknown.data(), unknown.size()), 0u);
+    EXPECT_EQ(decoder.Errors(), 2u);
+    EXPECT_EQ(decoder.read(buf, s), 1u);
+    delete decoder.GetProtobufMessage();
+
+    // a frame larger than the maximum is refused from its header alone, and so is the rest
+    // of the stream
+    LogPackage large;
+    for (int i = 0; i < 100; i++) {
+        large.AddLogEvent(Event(std::string(100, 'x'), "message", "provider", "", 1u, i));
+    }
+    char *largeBuf;
+    size_t largeSize;
+    large.toBytes(&largeBuf, &largeSize, FrameOption(Codec::none, 0));
+    decoder.SetMaxFrameSize(4096);
+    EXPECT_EQ(decoder.read(largeBuf, PACKAGE_FIXED_HEADER_SIZE), 0u);
+    EXPECT_EQ(decoder.Errors(), 3u);
+    EXPECT_EQ(decoder.read(buf, s), 0u);
+
+    decoder.Reset();
+    EXPECT_EQ(decoder.read(buf, s), 1u);
+    delete decoder.GetProtobufMessage();
+
+    ReleaseBuffer(largeBuf);
+    ReleaseBuffer(buf);
+}
+
+std::string eventXml(uint32_t rid)
+{
+    return "<Event xmlns='http://schemas.microsoft.com/win/2004/08/events/event'><System>"
+           "<Provider Name='Microsoft-Windows-Security-Auditing' "
+           "Guid='{54849625-5478-4994-a5ba-3e3b0328c30d}'/><EventID>4624</EventID>"
+           "<Version>2</Version><Level>0</Level><Task>12544</Task><Opcode>0</Opcode>"
+           "<Keywords>0x8020000000000000</Keywords><TimeCreated SystemTime='2020-01-01T00:00:"
+           + std::to_string(rid % 60) + "Z'/><EventRecordID>" + std::to_string(rid)
+           + "</EventRecordID><Correlation/><Execution ProcessID='4' ThreadID='"
+           + std::to_string(rid * 7 % 1000)
+           + "'/><Channel>Security</Channel><Computer>WIN-AGENT</Computer></System></Event>";
+}
+
+TEST(protobufLib, dictionaries)
+{
+    std::string dict;
+    for (uint32_t i = 0; i < 20; i++) {
+        dict += eventXml(i * 13);
+    }
+    const uint8_t id = 7;
+    ASSERT_TRUE(LoadDictionary(id, dict.data(), dict.size()));
+    EXPECT_FALSE(LoadDictionary(id, dict.data(), dict.size()));
+
+    LogPackage p;
+    for (uint32_t i = 0; i < 30; i++) {
+        p.AddLogEvent(Event(eventXml(1000 + i), "An account was logged on.", "Security",
+                            "2020-01-01 00:00:00", 0u, 1000 + i));
+    }
+
+    for (auto codec : {Codec::zlib, Codec::zstd}) {
+        if ((SupportedCodecs() & (1u << static_cast<int>(codec))) == 0) {
+            continue;
+        }
+        char *plain, *shared;
+        size_t plainSize, sharedSize;
+        EXPECT_TRUE(p.toBytes(&plain, &plainSize, FrameOption(codec, 3)));
+        EXPECT_TRUE(
+            p.toBytes(&shared, &sharedSize, FrameOption(codec, 3, Checksum::crc32c, id)));
+        EXPECT_LT(sharedSize, plainSize);
+
+        ProtobufPacketDecoder decoder;
+        EXPECT_EQ(decoder.read(shared, sharedSize), 1u);
+        auto *r = dynamic_cast<LogPackage *>(decoder.GetProtobufMessage());
+        ASSERT_TRUE(r != nullptr);
+        EXPECT_EQ(r->GetEvents().back().xml, p.GetEvents().back().xml);
+
+        ReleaseBuffer(plain);
+        ReleaseBuffer(shared);
+        delete r;
+    }
+
+    // only a dictionary the peer has loaded with the same content is negotiated
+    ConnectPackage agent;
+    ASSERT_EQ(agent.Dictionaries().size(), 1u);
+    EXPECT_EQ(agent.Negotiate(FrameOption(Codec::zlib, 6, Checksum::crc32c, id)).dictionary, id);
+    EXPECT_EQ(agent.Negotiate(FrameOption(Codec::zlib, 6, Checksum::crc32c, id + 1)).dictionary,
+              0);
+    EXPECT_EQ(agent.Negotiate(FrameOption(Codec::none, 0, Checksum::crc32c, id)).dictionary, 0);
+}
+
+TEST(protobufLib, uploadWindow)
+{
+    // the smaller window wins
+    FrameOption option;
+    option.window = 32;
+    ConnectPackage wide(option);
+    option.window = 4;
+    EXPECT_EQ(wide.Negotiate(option).window, 4u);
+    option.window = 0;
+    EXPECT_EQ(wide.Negotiate(option).window, 1u);
+
+    // an agent that does not announce a window gets stop-and-wait
+    coreMessage core;
+    core.set_op(coreMessage_Operation_CONNECT);
+    core.mutable_option()->set_codecs(SupportedCodecs());
+    auto *old = dynamic_cast<ConnectPackage *>(CoreMessage::BuildObj(core));
+    ASSERT_TRUE(old != nullptr);
+    EXPECT_EQ(old->Negotiate(FrameOption()).window, 1u);
+    delete old;
+
+    // acks name the last package stored, refusals the package refused
+    CoreMessage *messages[] = {new AcceptLastEventPackage(10, 7), new RefusePackage(8, "full")};
+    ProtobufPacketDecoder decoder;
+    for (auto m : messages) {
+        char *buf;
+        size_t s;
+        ASSERT_TRUE(m->toBytes(&buf, &s));
+        decoder.read(buf, s);
+        ReleaseBuffer(buf);
+    }
+    auto *ack = dynamic_cast<AcceptLastEventPackage *>(decoder.GetProtobufMessage());
+    ASSERT_TRUE(ack != nullptr);
+    EXPECT_EQ(ack->GetLastEventID(), 10u);
+    EXPECT_EQ(ack->AcceptedID(), 7);
+    auto *refuse = dynamic_cast<RefusePackage *>(decoder.GetProtobufMessage());
+    ASSERT_TRUE(refuse != nullptr);
+    EXPECT_EQ(refuse->RefusedID(), 8);
+    EXPECT_EQ(refuse->Description(), "full");
+    delete ack;
+    delete refuse;
+    for (auto m : messages) {
+        delete m;
+    }
+
+    // ids compare across the wraparound
+    EXPECT_TRUE(MessageIdBefore(1, 2));
+    EXPECT_FALSE(MessageIdBefore(2, 2));
+    EXPECT_TRUE(MessageIdBefore(INT32_MAX, INT32_MIN));
+    EXPECT_TRUE(MessageIdBefore(-2, 1));
+    EXPECT_FALSE(MessageIdBefore(1, -2));
+
+    // every message gets an id of its own
+    QueryLastEventPackage a, b;
+    EXPECT_NE(a.Id(), 0);
+    EXPECT_TRUE(MessageIdBefore(a.Id(), b.Id()));
+}
+
+TEST(protobufLib, heartbeat)
+{
+    // announced in CONNECT, absent from agents that do not know it
+    ConnectPackage agent;
+    EXPECT_TRUE(agent.Heartbeats());
+    coreMessage core;
+    core.set_op(coreMessage_Operation_CONNECT);
+    auto *old = dynamic_cast<ConnectPackage *>(CoreMessage::BuildObj(core));
+    ASSERT_TRUE(old != nullptr);
+    EXPECT_FALSE(old->Heartbeats());
+    delete old;
+
+    CoreMessage *messages[] = {&agent, new HeartbeatPackage};
+    ProtobufPacketDecoder decoder;
+    for (auto m : messages) {
+        char *buf;
+        size_t s;
+        ASSERT_TRUE(m->toBytes(&buf, &s));
+        decoder.read(buf, s);
+        ReleaseBuffer(buf);
+    }
+    auto *cp = dynamic_cast<ConnectPackage *>(decoder.GetProtobufMessage());
+    ASSERT_TRUE(cp != nullptr);
+    EXPECT_TRUE(cp->Heartbeats());
+    auto *hb = decoder.GetProtobufMessage();
+    ASSERT_TRUE(hb != nullptr);
+    EXPECT_EQ(hb->Op(), Operation::HEARTBEAT);
+    delete cp;
+    delete hb;
+    delete messages[1];
+}
+
+TEST(protobufLib, idleState)
+{
+    // without an idle timeout only the heartbeats check the connection
+    IdleState s;
+    s.heartbeats = true;
+    s.lastActive = 100;
+    EXPECT_EQ(s.Due(0, 60), 160u);
+    EXPECT_EQ(s.Next(159, 0, 60), IdleState::Check::none);
+    EXPECT_EQ(s.Next(160, 0, 60), IdleState::Check::heartbeat);
+    EXPECT_EQ(s.Due(0, 60), UINT64_MAX);
+    // the answer brings the next heartbeat forward, every interval
+    EXPECT_TRUE(s.Active(161));
+    EXPECT_EQ(s.Due(0, 60), 221u);
+    EXPECT_FALSE(s.Active(170));
+    EXPECT_EQ(s.Next(230, 0, 60), IdleState::Check::heartbeat);
+    EXPECT_TRUE(s.Active(231));
+    EXPECT_EQ(s.Due(0, 60), 291u);
+
+    // with one, the heartbeat comes first and closing after it
+    IdleState t;
+    t.heartbeats = true;
+    EXPECT_EQ(t.Due(300, 60), 60u);
+    EXPECT_EQ(t.Next(60, 300, 60), IdleState::Check::heartbeat);
+    EXPECT_EQ(t.Due(300, 60), 300u);
+    EXPECT_TRUE(t.Active(70));
+    EXPECT_EQ(t.Due(300, 60), 130u);
+    EXPECT_EQ(t.Next(370, 300, 60), IdleState::Check::close);
+
+    // agents that do not answer heartbeats are only closed
+    IdleState old;
+    EXPECT_EQ(old.Due(0, 60), UINT64_MAX);
+    EXPECT_EQ(old.Due(300, 60), 300u);
+    EXPECT_EQ(old.Next(299, 300, 60), IdleState::Check::none);
+    EXPECT_FALSE(old.Active(299));
+}
+
+TEST(protobufLib, timeStamp)
+{
+    auto wall = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::system_clock::now().time_since_epoch())
+                    .count();
+    auto us = getEpochMicroseconds();
+    EXPECT_LT(std::abs(us - wall), 1000000);
+    EXPECT_GE(getEpochMicroseconds(), us);
+
+    // "YYYY-MM-DD hh:mm:ss.mmm+hh:mm"
+    std::string ts;
+    getTimeStamp(ts);
+    ASSERT_EQ(ts.size(), 29u) << ts;
+    for (size_t i : {4, 7}) {
+        EXPECT_EQ(ts[i], '-');
+    }
+    EXPECT_EQ(ts[10], ' ');
+    EXPECT_EQ(ts[19], '.');
+    for (size_t i = 20; i < 23; i++) {
+        EXPECT_TRUE(isdigit(ts[i])) << ts;
+    }
+    EXPECT_TRUE(ts[23] == '+' || ts[23] == '-') << ts;
+    EXPECT_EQ(ts[26], ':') << ts;
+    for (size_t i : {24, 25, 27, 28}) {
+        EXPECT_TRUE(isdigit(ts[i])) << ts;
+    }
+
+#if !defined WINDOWS && !defined _WINDOWS_
+    // zones off by minutes keep them, and the sign of one less than an hour west of UTC.
+    // A thread of its own starts without cached text.
+    const char *tz = getenv("TZ");
+    std::string savedTz = tz != nullptr ? tz : "";
+    for (auto zone : {std::make_pair("<-0030>0:30", "-00:30"),
+                      std::make_pair("<+0530>-5:30", "+05:30"),
+                      std::make_pair("<-0330>3:30", "-03:30")}) {
+        setenv("TZ", zone.first, 1);
+        tzset();
+        std::string zoned;
+        std::thread([&zoned]() { getTimeStamp(zoned); }).join();
+        EXPECT_EQ(zoned.substr(23), zone.second) << zone.first;
+    }
+    if (tz != nullptr) {
+        setenv("TZ", savedTz.c_str(), 1);
+    } else {
+        unsetenv("TZ");
+    }
+    tzset();
+#endif
+
+    // the cached text moves on with the clock
+    std::string later;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    getTimeStamp(later);
+    EXPECT_LT(ts, later);
+
+    // messages without a time stamp of their own are stamped when they are built
+    QueryLastEventPackage q;
+    char *buf;
+    size_t s;
+    q.toBytes(&buf, &s);
+    ProtobufPacketDecoder decoder;
+    decoder.read(buf, s);
+    auto *r = decoder.GetProtobufMessage();
+    ASSERT_TRUE(r != nullptr);
+    EXPECT_EQ(r->TimeStamp().size(), ts.size());
+    EXPECT_LE(later.substr(0, 19), r->TimeStamp().substr(0, 19));
+    ReleaseBuffer(buf);
+    delete r;
+}
+
+TEST(protobufLib, bufferPool)
+{
+    // a released buffer serves the next request of its class
+    char *a = AcquireBuffer(1000);
+    memset(a, 1, 1000);
+    ReleaseBuffer(a);
+    auto before = GetBufferPoolStatistics();
+    char *b = AcquireBuffer(900);
+    EXPECT_EQ(b, a);
+    auto after = GetBufferPoolStatistics();
+    EXPECT_EQ(after.hits, before.hits + 1);
+    EXPECT_EQ(after.misses, before.misses);
+
+    // buffers released on another thread come back through the depot
+    std::vector<char *> bufs;
+    for (int i = 0; i < 64; i++) {
+        bufs.push_back(AcquireBuffer(64 * 1024));
+        memset(bufs.back(), 2, 64 * 1024);
+    }
+    std::thread([&bufs]() {
+        for (auto p : bufs) {
+            ReleaseBuffer(p);
+        }
+    }).join();
+    EXPECT_GE(GetBufferPoolStatistics().bytesHeld, 64u * 64 * 1024);
+    before = GetBufferPoolStatistics();
+    char *c = AcquireBuffer(64 * 1024);
+    EXPECT_EQ(GetBufferPoolStatistics().hits, before.hits + 1);
+
+    // requests above the largest class are not pooled
+    char *d = AcquireBuffer(BUFFER_MAX_CLASS);
+    memset(d, 3, BUFFER_MAX_CLASS);
+
+    ReleaseBuffer(b);
+    ReleaseBuffer(c);
+    ReleaseBuffer(d);
+    ReleaseBuffer(nullptr);
+}
+
 int main(int argc, char *argv[])
 {
     ::testing::InitGoogleTest(&argc, argv);
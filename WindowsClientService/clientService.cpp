@@ -7,6 +7,7 @@
 _declspec(dllexport) void start()
 {
     initProtobufLibrary();
+    LoadDictionaries();
 
     auto &dispatcher = service::HandlerDispatcher::GetHandlerDispatcher(
          "10.70.20.60", 53222);
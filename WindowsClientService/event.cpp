@@ -5,6 +5,7 @@
 
 #include <tinyxml2.h>
 #include <winevt.h>
+#include <algorithm>
 #include <iostream>
 #include <unordered_map>
 
@@ -283,27 +284,39 @@ namespace service
                     OutputDebugStringEx(L"ThreadStopEvent occur. Thread exiting...\n");
                     break;
                 } else if (EVENT_SUBCRIBE_EVENT == event || EVENT_UPLOAD_LAST_ID_EVENT == event) {
-                    eventsToSend.clear();
-                    int count = EnumerateResults(hSubscription, lastEventIDUploaded, eventsToSend);
-
-                    if (count < 0) {
-                        break;
-                    } else {
-                        LogPackage* lp =
-                            new LogPackage(count == EventForwardHandler::eventsPerSend);
-                        lp->AddLogEvent(eventsToSend);
-                        char* buffer;
-                        size_t size;
-                        lp->toBytes(&buffer, &size);
-                        HandlerDispatcher::GetHandlerDispatcher().Send(buffer, size);
-                        delete lp;
-                    }
-
+                    // reset first: new events or acks arriving while sending signal again
                     if (event == EVENT_SUBCRIBE_EVENT) {
                         ResetEvent(aWaitHandles[EVENT_SUBCRIBE_EVENT]);
                     } else {
                         ResetEvent(aWaitHandles[EVENT_UPLOAD_LAST_ID_EVENT]);
                     }
+
+                    // fill the window; every ack makes room for more, so a backlog streams at
+                    // the speed of the link instead of one package per round trip
+                    int count = 0;
+                    while (InFlight() < uploadWindow) {
+                        eventsToSend.clear();
+                        count = EnumerateResults(hSubscription, lastEventIDUploaded, eventsToSend);
+                        if (count < 0) {
+                            break;
+                        }
+                        if (!eventsToSend.empty()) {
+                            LogPackage lp(true);
+                            lp.AddLogEvent(eventsToSend);
+                            {
+                                std::lock_guard<std::mutex> lock(inFlightMutex);
+                                inFlight.push_back(lp.Id());
+                            }
+                            HandlerDispatcher::GetHandlerDispatcher().Send(lp);
+                        }
+                        if (count != EventForwardHandler::eventsPerSend) {
+                            // the subscription is drained
+                            break;
+                        }
+                    }
+                    if (count < 0) {
+                        break;
+                    }
                 } else {
                     if (WAIT_FAILED == dwWait) {
                         OutputDebugStringEx(L"WaitForSingleObject failed with %s\n",
@@ -333,7 +346,8 @@ namespace service
         }
     }
 
-    EventForwardHandler::EventForwardHandler() : lastEventIDUploaded(0), hSubscription(nullptr)
+    EventForwardHandler::EventForwardHandler()
+        : lastEventIDUploaded(0), uploadWindow(1), hSubscription(nullptr)
     {
         ZeroMemory(aWaitHandles, sizeof aWaitHandles);
 
@@ -352,14 +366,32 @@ namespace service
         assert(q.toBytes(&buf, &size));
     }
 
+    size_t EventForwardHandler::InFlight()
+    {
+        std::lock_guard<std::mutex> lock(inFlightMutex);
+        return inFlight.size();
+    }
+
+    void EventForwardHandler::Acknowledge(int id)
+    {
+        std::lock_guard<std::mutex> lock(inFlightMutex);
+        if (id == 0) {
+            // a server that does not name the package acknowledges one at a time
+            if (!inFlight.empty()) {
+                inFlight.pop_front();
+            }
+            return;
+        }
+        while (!inFlight.empty() && !MessageIdBefore(id, inFlight.front())) {
+            inFlight.pop_front();
+        }
+    }
+
     void EventForwardHandler::NetworkStartFinished()
     {
+        uploadWindow = HandlerDispatcher::GetHandlerDispatcher().GetFrameOption().window;
         QueryLastEventPackage q;
-        char* buf;
-        size_t size;
-        q.toBytes(&buf, &size);
-
-        HandlerDispatcher::GetHandlerDispatcher().Send(buf, size);
+        HandlerDispatcher::GetHandlerDispatcher().Send(q);
     }
 
     void EventForwardHandler::GetProtobufPackage(protobuf::CoreMessage* msg)
@@ -379,9 +411,24 @@ namespace service
                 auto lid = rep->GetLastEventID();
                 this->lastEventIDUploaded = lid;
                 OutputDebugStringEx("Accept Last Event ID %d from remote.\n", lid);
+                Acknowledge(rep->AcceptedID());
                 SetEvent(aWaitHandles[EVENT_UPLOAD_LAST_ID_EVENT]);
             } catch (std::bad_cast&) {
             }
+        } else if (msg->Op() == Operation::REFUSE) {
+            // a refused package is dropped, as before; its room in the window is free again
+            auto ref = dynamic_cast<RefusePackage*>(msg);
+            if (ref != nullptr) {
+                OutputDebugStringEx("Package %d refused: %s\n",
+                                    ref->RefusedID(),
+                                    ref->Description().c_str());
+                std::lock_guard<std::mutex> lock(inFlightMutex);
+                auto p = std::find(inFlight.begin(), inFlight.end(), ref->RefusedID());
+                if (p != inFlight.end()) {
+                    inFlight.erase(p);
+                }
+            }
+            SetEvent(aWaitHandles[EVENT_UPLOAD_LAST_ID_EVENT]);
         }
     }
 
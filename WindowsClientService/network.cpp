@@ -9,9 +9,12 @@
 
 namespace
 {
-    void uvAllocateBufferCB(uv_handle_t* handle, size_t size, uv_buf_t* buf)
+    // reads go into a buffer of the pool, returned once the read is decoded
+    constexpr size_t RECEIVE_BUFFER_SIZE = 64 * 1024 - protobuf::BUFFER_HEADER_SIZE;
+
+    void uvAllocateBufferCB(uv_handle_t* handle, size_t, uv_buf_t* buf)
     {
-        *buf = uv_buf_init(new char[size], size);
+        *buf = uv_buf_init(protobuf::AcquireBuffer(RECEIVE_BUFFER_SIZE), RECEIVE_BUFFER_SIZE);
     }
 
 
@@ -40,7 +43,7 @@ namespace service
         }
 
         auto bufs = reinterpret_cast<uv_buf_t*>(w->data);
-        delete[](bufs[0].base);
+        ReleaseBuffer(bufs[0].base);
         delete[] bufs;
         delete w;
     }
@@ -54,13 +57,15 @@ namespace service
 
             uv_read_start(*nh, uvAllocateBufferCB, uvNetworkReadCB);
 
-            protobuf::ConnectPackage conn;
-
-            char* buf;
-            size_t size;
-            conn.toBytes(&buf, &size);
-
-            nh->Send(buf, size);
+            // a new connection starts in the default frame option, without a session, until
+            // the server assigns them: a restarted server may lack the codec or dictionary
+            // negotiated last time. Only the window, a local preference, is kept.
+            auto window = nh->option.window;
+            nh->option = FrameOption();
+            nh->option.window = window;
+            nh->decoder.Reset();
+            protobuf::ConnectPackage conn(nh->option);
+            nh->Send(conn);
 
         } else {
             OutputDebugStringEx("Connect failed: %s\n", uv_strerror(status));
@@ -72,18 +77,38 @@ namespace service
         HandlerDispatcher* handler = reinterpret_cast<HandlerDispatcher*>(stream->data);
 
         if (size > 0) {
+            auto errors = handler->decoder.Errors();
             handler->decoder.read(bufs->base, size);
-            CoreMessage* msg = handler->decoder.GetProtobufMessage();
-            if (msg != nullptr) {
+            if (handler->decoder.Errors() > errors) {
+                OutputDebugStringEx("Dropped %llu frame(s) that cannot be decoded.\n",
+                                    static_cast<unsigned long long>(handler->decoder.Errors()
+                                                                    - errors));
+            }
+            CoreMessage* msg;
+            while ((msg = handler->decoder.GetProtobufMessage()) != nullptr) {
                 if (msg->Op() == Operation::CONNECT) {
+                    auto cp = dynamic_cast<ConnectPackage*>(msg);
+                    if (cp != nullptr) {
+                        handler->option = cp->GetFrameOption();
+                        OutputDebugStringEx(
+                            "Frames use %s (level %d), checksum %s, dictionary %d, session %u.\n",
+                            CodecName(handler->option.codec),
+                            handler->option.level,
+                            ChecksumName(handler->option.checksum),
+                            handler->option.dictionary,
+                            handler->option.session);
+                    }
                     handler->NetworkStartFinished();
+                } else if (msg->Op() == Operation::HEARTBEAT) {
+                    HeartbeatPackage hb;
+                    handler->Send(hb);
                 } else {
                     HandlerDispatcher::GetHandlerDispatcher().SubmitProtobufPackage(msg);
                 }
                 delete msg;
             }
         }
-        delete[] bufs->base;
+        ReleaseBuffer(bufs->base);
     }
 
     void HandlerDispatcher::WSAErrorHandler(DWORD dwErr)
@@ -184,6 +209,8 @@ namespace service
         tcp = new uv_tcp_t;
         uv_tcp_init(_loop, tcp);
         tcp->data = this;
+
+        decoder.SetStatistics(&stats);
     }
 
     bool HandlerDispatcher::Connect()
@@ -207,4 +234,15 @@ namespace service
         return uv_write(w, reinterpret_cast<uv_stream_t*>(tcp), bufs, 1, uvNetworkWriteCB);
     }
 
+    bool HandlerDispatcher::Send(CoreMessage& msg)
+    {
+        char* buf;
+        size_t size;
+        if (!msg.toBytes(&buf, &size, option, &stats)) {
+            ReleaseBuffer(buf);
+            return false;
+        }
+        return Send(buf, size);
+    }
+
 }  // namespace service
\ No newline at end of file
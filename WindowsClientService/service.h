@@ -15,6 +15,7 @@
 
 #include <atomic>
 #include <cstdint>
+#include <deque>
 #include <string>
 #include <vector>
 #include <sstream>
@@ -39,6 +40,9 @@ LPWSTR Convert(LPCSTR in);
 
 void Convert(std::wstring& out, const std::string& in);
 
+// loads the compression dictionaries (*.dict) shipped next to this module
+void LoadDictionaries();
+
 DWORD WINAPI ServiceThreadStartPROC(LPVOID param);
 
 namespace service
@@ -85,6 +89,17 @@ namespace service
     {
         std::atomic_uint32_t lastEventIDUploaded;
 
+        // LogPackages sent ahead of the server's acks: at most `uploadWindow', as negotiated
+        // in CONNECT. Ids of those not acknowledged yet, oldest first.
+        std::atomic_uint32_t uploadWindow;
+        std::deque<int> inFlight;
+        std::mutex inFlightMutex;
+
+        size_t InFlight();
+
+        // the server stored every package up to `id'
+        void Acknowledge(int id);
+
         EVT_HANDLE hSubscription;
 
         HANDLE aWaitHandles[3];
@@ -144,6 +159,10 @@ namespace service
 
         protobuf::ProtobufPacketDecoder decoder;
 
+        // frame option negotiated with the server, and what it did to our traffic
+        protobuf::FrameOption option;
+        protobuf::FrameStatistics stats;
+
         void InitTCP();
 
     public:
@@ -161,6 +180,13 @@ namespace service
 
         bool Send(char*, size_t);
 
+        bool Send(protobuf::CoreMessage&);
+
+        const protobuf::FrameOption& GetFrameOption() const
+        {
+            return option;
+        }
+
         static void initNetworkHandler();
 
         uv_loop_t* _loop;
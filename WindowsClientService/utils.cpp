@@ -88,3 +88,37 @@ void Convert(std::wstring& out, const std::string& in)
     //std::string narrow = converter.to_bytes(wide_utf16_source_string);
     out = converter.from_bytes(in);
 }
+
+void LoadDictionaries()
+{
+    HMODULE module = NULL;
+    if (!GetModuleHandleExA(
+            GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+            (LPCSTR)&LoadDictionaries,
+            &module)) {
+        return;
+    }
+
+    char path[MAX_PATH] = {0};
+    DWORD l = GetModuleFileNameA(module, path, MAX_PATH);
+    if (l == 0 || l == MAX_PATH) {
+        return;
+    }
+    std::string dir(path, l);
+    dir.erase(dir.find_last_of('\\') + 1);
+
+    WIN32_FIND_DATAA fd;
+    HANDLE h = FindFirstFileA((dir + "*.dict").c_str(), &fd);
+    if (h == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    do {
+        uint8_t id;
+        if (protobuf::LoadDictionaryFile(dir + fd.cFileName, &id)) {
+            OutputDebugStringEx("Compression dictionary %d loaded from %s.\n", id, fd.cFileName);
+        } else {
+            OutputDebugStringEx("Load compression dictionary %s failed.\n", fd.cFileName);
+        }
+    } while (FindNextFileA(h, &fd));
+    FindClose(h);
+}
@@ -0,0 +1,243 @@
+#include "protobufLib.h"
+
+#include <cassert>
+#include <cstdlib>
+#include <new>
+
+#if defined __linux__
+#include <sys/mman.h>
+#endif
+
+using namespace protobuf;
+
+namespace
+{
+    constexpr int MIN_CLASS_SHIFT = 8;
+    constexpr int CLASS_COUNT = 15;
+    static_assert(BUFFER_MIN_CLASS == size_t(1) << MIN_CLASS_SHIFT, "BUFFER_MIN_CLASS");
+    static_assert(BUFFER_MAX_CLASS == BUFFER_MIN_CLASS << (CLASS_COUNT - 1), "BUFFER_MAX_CLASS");
+
+    // size class of buffers larger than BUFFER_MAX_CLASS
+    constexpr uint32_t UNPOOLED = 0xff;
+
+    constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    // free bytes kept per class by every thread and by the depot
+    constexpr size_t THREAD_CACHE_BYTES = 1024 * 1024;
+    constexpr size_t DEPOT_BYTES = 16 * 1024 * 1024;
+
+    // in front of every buffer
+    struct alignas(16) BufferHeader {
+        size_t size;
+        uint32_t sizeClass;
+    };
+    static_assert(sizeof(BufferHeader) == BUFFER_HEADER_SIZE, "BUFFER_HEADER_SIZE");
+
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> bytesHeld{0};
+    std::atomic_bool hugePages{false};
+
+    size_t classSize(uint32_t c)
+    {
+        return BUFFER_MIN_CLASS << c;
+    }
+
+    uint32_t sizeClass(size_t size)
+    {
+        size += BUFFER_HEADER_SIZE;
+        uint32_t c = 0;
+        while (c < CLASS_COUNT && classSize(c) < size) {
+            c++;
+        }
+        return c < CLASS_COUNT ? c : UNPOOLED;
+    }
+
+    // how many free buffers of class `c' a cache of `bytes' keeps
+    size_t cacheLimit(uint32_t c, size_t bytes, size_t max)
+    {
+        return std::min(max, std::max<size_t>(1, bytes / classSize(c)));
+    }
+
+    BufferHeader* allocate(uint32_t c, size_t size)
+    {
+        void* p = nullptr;
+#if defined __linux__ && defined MADV_HUGEPAGE
+        if (size >= HUGE_PAGE_SIZE && hugePages.load(std::memory_order_relaxed)) {
+            // transparent huge pages only back aligned 2 MiB ranges
+            size_t aligned = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+            p = std::aligned_alloc(HUGE_PAGE_SIZE, aligned);
+            if (p != nullptr) {
+                madvise(p, aligned, MADV_HUGEPAGE);
+            }
+        }
+#endif
+        if (p == nullptr) {
+            p = std::malloc(size);
+        }
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+        auto h = static_cast<BufferHeader*>(p);
+        h->size = size;
+        h->sizeClass = c;
+        return h;
+    }
+
+    void deallocate(BufferHeader* h)
+    {
+        std::free(h);
+    }
+
+    // free buffers shared by all threads
+    class Depot
+    {
+        std::mutex _mutex;
+        std::vector<BufferHeader*> _free[CLASS_COUNT];
+
+    public:
+        BufferHeader* take(uint32_t c)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_free[c].empty()) {
+                return nullptr;
+            }
+            auto h = _free[c].back();
+            _free[c].pop_back();
+            return h;
+        }
+
+        // false if the depot is full
+        bool put(BufferHeader* h)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto& cached = _free[h->sizeClass];
+            if (cached.size() >= cacheLimit(h->sizeClass, DEPOT_BYTES, 64)) {
+                return false;
+            }
+            cached.push_back(h);
+            return true;
+        }
+    };
+
+    // never destroyed: buffers may still be released while static objects are destroyed
+    Depot& depot()
+    {
+        static Depot* d = new Depot;
+        return *d;
+    }
+
+    void keepOrFree(BufferHeader* h)
+    {
+        if (!depot().put(h)) {
+            bytesHeld -= classSize(h->sizeClass);
+            deallocate(h);
+        }
+    }
+
+    // free buffers of one thread, handed to the depot when the thread exits
+    class ThreadCache
+    {
+        std::vector<BufferHeader*> _free[CLASS_COUNT];
+
+    public:
+        static thread_local bool destroyed;
+
+        ~ThreadCache()
+        {
+            destroyed = true;
+            for (auto& cached : _free) {
+                for (auto h : cached) {
+                    keepOrFree(h);
+                }
+            }
+        }
+
+        BufferHeader* take(uint32_t c)
+        {
+            if (_free[c].empty()) {
+                return depot().take(c);
+            }
+            auto h = _free[c].back();
+            _free[c].pop_back();
+            return h;
+        }
+
+        void put(BufferHeader* h)
+        {
+            auto& cached = _free[h->sizeClass];
+            if (cached.size() < cacheLimit(h->sizeClass, THREAD_CACHE_BYTES, 16)) {
+                cached.push_back(h);
+            } else {
+                keepOrFree(h);
+            }
+        }
+    };
+
+    thread_local bool ThreadCache::destroyed = false;
+
+    // the cache of this thread, or nullptr once it is gone at thread exit
+    ThreadCache* threadCache()
+    {
+        thread_local ThreadCache cache;
+        return ThreadCache::destroyed ? nullptr : &cache;
+    }
+}  // namespace
+
+char* protobuf::AcquireBuffer(size_t size)
+{
+    uint32_t c = sizeClass(size);
+    if (c == UNPOOLED) {
+        misses++;
+        return reinterpret_cast<char*>(allocate(UNPOOLED, size + BUFFER_HEADER_SIZE) + 1);
+    }
+
+    auto cache = threadCache();
+    BufferHeader* h = cache != nullptr ? cache->take(c) : depot().take(c);
+    if (h != nullptr) {
+        hits++;
+        bytesHeld -= classSize(c);
+    } else {
+        misses++;
+        h = allocate(c, classSize(c));
+    }
+    return reinterpret_cast<char*>(h + 1);
+}
+
+void protobuf::ReleaseBuffer(char* p)
+{
+    if (p == nullptr) {
+        return;
+    }
+    auto h = reinterpret_cast<BufferHeader*>(p) - 1;
+    if (h->sizeClass == UNPOOLED) {
+        deallocate(h);
+        return;
+    }
+    assert(h->sizeClass < CLASS_COUNT && h->size == classSize(h->sizeClass));
+
+    bytesHeld += classSize(h->sizeClass);
+    auto cache = threadCache();
+    if (cache != nullptr) {
+        cache->put(h);
+    } else {
+        keepOrFree(h);
+    }
+}
+
+BufferPoolStatistics protobuf::GetBufferPoolStatistics()
+{
+    return {hits.load(), misses.load(), bytesHeld.load()};
+}
+
+std::ostream& protobuf::operator<<(std::ostream& ios, const BufferPoolStatistics& stats)
+{
+    return ios << "buffer pool: " << stats.hits << " hits, " << stats.misses
+               << " misses (hit rate " << stats.HitRate() << "), " << stats.bytesHeld
+               << " bytes held.";
+}
+
+void protobuf::UseHugePageBuffers(bool use)
+{
+    hugePages = use;
+}
@@ -0,0 +1,281 @@
+
+#include "protobufLib.h"
+
+#include <cassert>
+
+#if defined _MSC_VER && (defined _M_X64 || defined _M_IX86)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define HAVE_CRC32C_INTRINSICS
+#elif (defined __GNUC__ || defined __clang__) && (defined __x86_64__ || defined __i386__)
+#include <nmmintrin.h>
+#define HAVE_CRC32C_INTRINSICS
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
+#endif
+
+#ifndef CRC32C_TARGET
+#define CRC32C_TARGET
+#endif
+
+#ifdef HAVE_XXHASH
+#include <xxhash.h>
+#endif
+
+using namespace protobuf;
+
+namespace
+{
+    // reflected Castagnoli polynomial
+    constexpr uint32_t CRC32C_POLY = 0x82F63B78;
+
+    // slicing-by-8 tables for CPUs without the SSE 4.2 crc32 instruction
+    struct Crc32cTable {
+        uint32_t t[8][256];
+
+        Crc32cTable()
+        {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t crc = i;
+                for (int k = 0; k < 8; k++) {
+                    crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+                }
+                t[0][i] = crc;
+            }
+            for (uint32_t i = 0; i < 256; i++) {
+                for (int k = 1; k < 8; k++) {
+                    t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+                }
+            }
+        }
+    };
+
+    uint32_t crc32cSoftware(uint32_t crc, const unsigned char* p, size_t n)
+    {
+        static const Crc32cTable table;
+        const auto& t = table.t;
+
+        while (n >= 8) {
+            uint32_t lo = crc ^ (uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16
+                                 | uint32_t(p[3]) << 24);
+            crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff]
+                  ^ t[4][lo >> 24] ^ t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+            p += 8;
+            n -= 8;
+        }
+        while (n--) {
+            crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+        }
+        return crc;
+    }
+
+#ifdef HAVE_CRC32C_INTRINSICS
+    CRC32C_TARGET uint32_t crc32cHardware(uint32_t crc, const unsigned char* p, size_t n)
+    {
+#if defined _M_X64 || defined __x86_64__
+        uint64_t crc64 = crc;
+        while (n >= 8) {
+            uint64_t v;
+            memcpy(&v, p, 8);
+            crc64 = _mm_crc32_u64(crc64, v);
+            p += 8;
+            n -= 8;
+        }
+        crc = static_cast<uint32_t>(crc64);
+#endif
+        while (n >= 4) {
+            uint32_t v;
+            memcpy(&v, p, 4);
+            crc = _mm_crc32_u32(crc, v);
+            p += 4;
+            n -= 4;
+        }
+        while (n--) {
+            crc = _mm_crc32_u8(crc, *p++);
+        }
+        return crc;
+    }
+
+    bool cpuHasCrc32c()
+    {
+#if defined _MSC_VER
+        int info[4];
+        __cpuid(info, 1);
+        return (info[2] & (1 << 20)) != 0;
+#else
+        return __builtin_cpu_supports("sse4.2");
+#endif
+    }
+#endif
+
+    void putBigEndian(char* out, uint64_t v, int bytes)
+    {
+        for (int i = bytes - 1; i >= 0; i--) {
+            out[i] = static_cast<char>(v & 0xff);
+            v >>= 8;
+        }
+    }
+}  // namespace
+
+uint32_t protobuf::Crc32c(const void* data, size_t size, uint32_t crc)
+{
+    auto p = reinterpret_cast<const unsigned char*>(data);
+    crc = ~crc;
+#ifdef HAVE_CRC32C_INTRINSICS
+    static const bool hardware = cpuHasCrc32c();
+    if (hardware) {
+        return ~crc32cHardware(crc, p, size);
+    }
+#endif
+    return ~crc32cSoftware(crc, p, size);
+}
+
+uint32_t protobuf::SupportedChecksums()
+{
+    uint32_t ret = (1u << static_cast<int>(Checksum::sha256))
+                   | (1u << static_cast<int>(Checksum::crc32c));
+#ifdef HAVE_XXHASH
+    ret |= 1u << static_cast<int>(Checksum::xxh3);
+#endif
+    return ret;
+}
+
+const char* protobuf::ChecksumName(Checksum c)
+{
+    switch (c) {
+        case Checksum::sha256:
+            return "sha256";
+        case Checksum::crc32c:
+            return "crc32c";
+        case Checksum::xxh3:
+            return "xxh3";
+        default:
+            break;
+    }
+    return "unknown";
+}
+
+bool protobuf::ParseChecksum(const std::string& name, Checksum& c)
+{
+    for (int i = 0; i < CHECKSUM_COUNT; i++) {
+        if (name == ChecksumName(static_cast<Checksum>(i))) {
+            c = static_cast<Checksum>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t protobuf::DigestSize(Checksum c)
+{
+    switch (c) {
+        case Checksum::sha256:
+            return 32;
+        case Checksum::crc32c:
+            return 4;
+        case Checksum::xxh3:
+            return 8;
+        default:
+            break;
+    }
+    return 0;
+}
+
+void protobuf::Digest(Checksum c, const void* data, size_t size, char* out)
+{
+    switch (c) {
+        case Checksum::sha256:
+            SHA256(data, size, out);
+            break;
+        case Checksum::crc32c:
+            putBigEndian(out, Crc32c(data, size), 4);
+            break;
+#ifdef HAVE_XXHASH
+        case Checksum::xxh3:
+            putBigEndian(out, XXH3_64bits(data, size), 8);
+            break;
+#endif
+        default:
+            assert(false);
+            break;
+    }
+}
+
+DigestContext::~DigestContext()
+{
+    Reset(Checksum::crc32c);
+}
+
+void DigestContext::Reset(Checksum c)
+{
+    // drop the state of an unfinished sha256 digest; the xxh3 state is reused
+    if (_state != nullptr && _checksum == Checksum::sha256) {
+        char discard[32];
+        SHA256End(_state, discard);
+        _state = nullptr;
+    }
+#ifdef HAVE_XXHASH
+    if (_state != nullptr && c != Checksum::xxh3) {
+        XXH3_freeState(reinterpret_cast<XXH3_state_t*>(_state));
+        _state = nullptr;
+    }
+#endif
+
+    _checksum = c;
+    _crc = 0;
+    switch (c) {
+        case Checksum::sha256:
+            _state = SHA256Begin();
+            break;
+#ifdef HAVE_XXHASH
+        case Checksum::xxh3:
+            if (_state == nullptr) {
+                _state = XXH3_createState();
+            }
+            XXH3_64bits_reset(reinterpret_cast<XXH3_state_t*>(_state));
+            break;
+#endif
+        default:
+            break;
+    }
+}
+
+void DigestContext::Update(const void* data, size_t size)
+{
+    switch (_checksum) {
+        case Checksum::sha256:
+            SHA256Update(_state, data, size);
+            break;
+        case Checksum::crc32c:
+            _crc = Crc32c(data, size, _crc);
+            break;
+#ifdef HAVE_XXHASH
+        case Checksum::xxh3:
+            XXH3_64bits_update(reinterpret_cast<XXH3_state_t*>(_state), data, size);
+            break;
+#endif
+        default:
+            assert(false);
+            break;
+    }
+}
+
+void DigestContext::Final(char* out)
+{
+    switch (_checksum) {
+        case Checksum::sha256:
+            SHA256End(_state, out);
+            _state = nullptr;
+            break;
+        case Checksum::crc32c:
+            putBigEndian(out, _crc, 4);
+            break;
+#ifdef HAVE_XXHASH
+        case Checksum::xxh3:
+            putBigEndian(out, XXH3_64bits_digest(reinterpret_cast<XXH3_state_t*>(_state)), 8);
+            break;
+#endif
+        default:
+            assert(false);
+            break;
+    }
+}
@@ -0,0 +1,120 @@
+
+#include "protobufLib.h"
+
+#include <fstream>
+
+#if defined _WINDOWS_ || defined _WIN32
+#include <windows.h>
+#elif defined UNIX
+#include <arpa/inet.h>
+#endif
+
+using namespace protobuf;
+
+namespace
+{
+    struct DictionaryEntry {
+        std::string content;
+        uint32_t checksum;
+    };
+
+    // indexed by id. Entries are published once and live until exit, so readers need no lock.
+    std::atomic<const DictionaryEntry*> dictionaries[256];
+
+    std::mutex dictionaryMutex;
+
+    // dictionary file: magic, id, three reserved bytes, CRC-32C of the content (network order),
+    // then the content
+    const char DICTIONARY_MAGIC[4] = {'C', 'S', 'D', 'C'};
+    constexpr size_t DICTIONARY_HEADER_SIZE = 4 + 4 + 4;
+}  // namespace
+
+bool protobuf::CodecUsesDictionary(Codec c)
+{
+    return c == Codec::zlib || c == Codec::zstd;
+}
+
+bool protobuf::LoadDictionary(uint8_t id, const char* data, size_t size)
+{
+    if (id == 0 || size == 0) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(dictionaryMutex);
+    if (dictionaries[id].load() != nullptr) {
+        return false;
+    }
+    auto entry = new DictionaryEntry;
+    entry->content.assign(data, size);
+    entry->checksum = Crc32c(data, size);
+    dictionaries[id].store(entry);
+    return true;
+}
+
+const std::string* protobuf::GetDictionary(uint8_t id)
+{
+    auto entry = dictionaries[id].load(std::memory_order_acquire);
+    return entry == nullptr ? nullptr : &entry->content;
+}
+
+std::vector<DictionaryInfo> protobuf::LoadedDictionaries()
+{
+    std::vector<DictionaryInfo> ret;
+    for (int i = 1; i < 256; i++) {
+        auto entry = dictionaries[i].load(std::memory_order_acquire);
+        if (entry != nullptr) {
+            ret.push_back({static_cast<uint8_t>(i), entry->checksum});
+        }
+    }
+    return ret;
+}
+
+bool protobuf::LoadDictionaryFile(const std::string& path, uint8_t* id)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        return false;
+    }
+    std::string file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    if (file.size() <= DICTIONARY_HEADER_SIZE
+        || memcmp(file.data(), DICTIONARY_MAGIC, sizeof DICTIONARY_MAGIC) != 0) {
+        return false;
+    }
+
+    uint8_t dictID = static_cast<uint8_t>(file[4]);
+    uint32_t checksum;
+    memcpy(&checksum, file.data() + 8, 4);
+
+    const char* content = file.data() + DICTIONARY_HEADER_SIZE;
+    size_t size = file.size() - DICTIONARY_HEADER_SIZE;
+    if (ntohl(checksum) != Crc32c(content, size)) {
+        return false;
+    }
+
+    if (id != nullptr) {
+        *id = dictID;
+    }
+    return LoadDictionary(dictID, content, size);
+}
+
+bool protobuf::SaveDictionaryFile(const std::string& path,
+                                  uint8_t id,
+                                  const char* data,
+                                  size_t size)
+{
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        return false;
+    }
+
+    char header[DICTIONARY_HEADER_SIZE] = {0};
+    memcpy(header, DICTIONARY_MAGIC, sizeof DICTIONARY_MAGIC);
+    header[4] = static_cast<char>(id);
+    uint32_t checksum = htonl(Crc32c(data, size));
+    memcpy(header + 8, &checksum, 4);
+
+    out.write(header, sizeof header);
+    out.write(data, size);
+    return static_cast<bool>(out);
+}
@@ -2,8 +2,13 @@
 #include "protobufLib.h"
 
 #include <cassert>
+#include <climits>
+#include <memory>
 #include <sstream>
 
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format_lite.h>
+
 #if defined _WINDOWS_ || defined _WIN32
 #include <windows.h>
 #elif defined UNIX && defined UNIX_HAVE_UNAME
@@ -16,6 +21,9 @@ using std::string;
 
 using namespace protobuf;
 
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::internal::WireFormatLite;
+
 namespace
 {
     Operation dispatch(coreMessage_Operation op)
@@ -33,6 +41,10 @@ namespace
                 return Operation::RETURN_LAST_EVENT;
             case coreMessage_Operation_ACCEPT_LAST_EVENT:
                 return Operation::ACCEPT_LAST_EVENT;
+            case coreMessage_Operation_REFUSE:
+                return Operation::REFUSE;
+            case coreMessage_Operation_HEARTBEAT:
+                return Operation::HEARTBEAT;
             case coreMessage_Operation_coreMessage_Operation_INT_MIN_SENTINEL_DO_NOT_USE_:
             case coreMessage_Operation_coreMessage_Operation_INT_MAX_SENTINEL_DO_NOT_USE_:
             default:
@@ -93,6 +105,10 @@ namespace
                 return coreMessage_Operation_RETURN_LAST_EVENT;
             case protobuf::Operation::ACCEPT_LAST_EVENT:
                 return coreMessage_Operation_ACCEPT_LAST_EVENT;
+            case protobuf::Operation::REFUSE:
+                return coreMessage_Operation_REFUSE;
+            case protobuf::Operation::HEARTBEAT:
+                return coreMessage_Operation_HEARTBEAT;
             default:
                 break;
         }
@@ -108,10 +124,325 @@ namespace
         }
     }
 
+    // message ids are handed out from any thread and wrap around; 0 means no message and -1
+    // asks the receiver for an id of its own, so neither is used.
     int nextID()
     {
-        static int id = 0;
-        return id++;
+        static std::atomic<uint32_t> id{1};
+        int ret;
+        do {
+            ret = static_cast<int>(id.fetch_add(1, std::memory_order_relaxed));
+        } while (ret == 0 || ret == -1);
+        return ret;
+    }
+
+    // arena the messages of this thread are parsed into. A parsed message only lives until
+    // BuildObj() has moved its strings out, so the arena is reset after every message; its
+    // first block survives the reset and grows to the largest message seen, so the message
+    // tree of steady traffic costs no allocation at all.
+    class ParseArena
+    {
+        static constexpr size_t MIN_BLOCK_SIZE = 16 * 1024;
+        static constexpr size_t MAX_BLOCK_SIZE = 4 * 1024 * 1024;
+
+        std::unique_ptr<char[]> _block;
+        size_t _blockSize;
+        std::unique_ptr<google::protobuf::Arena> _arena;
+
+        void create(size_t size)
+        {
+            _arena.reset();
+            _block.reset(new char[size]);
+            _blockSize = size;
+
+            google::protobuf::ArenaOptions options;
+            options.initial_block = _block.get();
+            options.initial_block_size = size;
+            _arena.reset(new google::protobuf::Arena(options));
+        }
+
+    public:
+        ParseArena() : _blockSize(0)
+        {
+            create(MIN_BLOCK_SIZE);
+        }
+
+        google::protobuf::Arena* get()
+        {
+            return _arena.get();
+        }
+
+        void reset()
+        {
+            size_t used = _arena->Reset();
+            if (used > _blockSize && _blockSize < MAX_BLOCK_SIZE) {
+                create(std::min(used, MAX_BLOCK_SIZE));
+            }
+        }
+    };
+
+    ParseArena& parseArena()
+    {
+        thread_local ParseArena arena;
+        return arena;
+    }
+
+    // a message on this thread's ParseArena, released when it goes out of scope. Only one is
+    // alive per thread at a time.
+    template <typename T>
+    class ArenaObject
+    {
+        ParseArena& _arena;
+        T* _msg;
+
+    public:
+        ArenaObject() : _arena(parseArena())
+        {
+            _msg = google::protobuf::Arena::CreateMessage<T>(_arena.get());
+        }
+
+        ~ArenaObject()
+        {
+            _arena.reset();
+        }
+
+        ArenaObject(const ArenaObject&) = delete;
+        ArenaObject& operator=(const ArenaObject&) = delete;
+
+        T* operator->()
+        {
+            return _msg;
+        }
+
+        T& operator*()
+        {
+            return *_msg;
+        }
+    };
+
+    using ArenaMessage = ArenaObject<coreMessage>;
+
+    // reads a length-delimited field of `in' as a view into the buffer `in' reads from
+    bool readView(CodedInputStream& in, std::string_view& out)
+    {
+        uint32_t size;
+        if (!in.ReadVarint32(&size)) {
+            return false;
+        }
+        if (size == 0) {
+            out = std::string_view();
+            return true;
+        }
+        const void* data;
+        int available;
+        if (!in.GetDirectBufferPointer(&data, &available)
+            || static_cast<uint32_t>(available) < size) {
+            return false;
+        }
+        out = std::string_view(reinterpret_cast<const char*>(data), size);
+        return in.Skip(static_cast<int>(size));
+    }
+
+    bool isString(uint32_t tag, int field)
+    {
+        return tag == WireFormatLite::MakeTag(field, WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+    }
+
+    bool isVarint(uint32_t tag, int field)
+    {
+        return tag == WireFormatLite::MakeTag(field, WireFormatLite::WIRETYPE_VARINT);
+    }
+
+    // decodes one serialized coreMessage.logPackage
+    bool decodeEvent(std::string_view record, EventView& evt)
+    {
+        using logEvent = coreMessage_logPackage;
+
+        CodedInputStream in(reinterpret_cast<const uint8_t*>(record.data()),
+                            static_cast<int>(record.size()));
+        evt = EventView();
+        uint32_t tag;
+        while ((tag = in.ReadTag()) != 0) {
+            bool ok;
+            if (isString(tag, logEvent::kXmlEventMessageFieldNumber)) {
+                ok = readView(in, evt.xml);
+            } else if (isString(tag, logEvent::kRawEventMessageFieldNumber)) {
+                ok = readView(in, evt.format);
+            } else if (isString(tag, logEvent::kTimeStampFieldNumber)) {
+                ok = readView(in, evt.timeStamp);
+            } else if (isString(tag, logEvent::kScopeFieldNumber)) {
+                ok = readView(in, evt.provider);
+            } else if (isVarint(tag, logEvent::kLevelFieldNumber)) {
+                ok = in.ReadVarint32(&evt.level);
+            } else if (isVarint(tag, logEvent::kRecordIDFieldNumber)) {
+                ok = in.ReadVarint32(&evt.rid);
+            } else {
+                ok = WireFormatLite::SkipField(&in, tag);
+            }
+            if (!ok) {
+                return false;
+            }
+        }
+        return in.ConsumedEntireMessage();
+    }
+
+    // copies the whole serialized message out of `in'
+    bool readSerial(FrameInputStream& in, char* out, size_t size)
+    {
+        const void* data;
+        int n;
+        size_t filled = 0;
+        while (filled < size && in.Next(&data, &n)) {
+            size_t take = std::min(static_cast<size_t>(n), size - filled);
+            memcpy(out + filled, data, take);
+            filled += take;
+            if (take < static_cast<size_t>(n)) {
+                in.BackUp(n - static_cast<int>(take));
+            }
+        }
+        return filled == size;
+    }
+
+    bool pushMessage(CoreMessage* msg, std::deque<CoreMessage*>& out)
+    {
+        if (msg != nullptr) {
+            out.push_back(msg);
+        }
+        return msg != nullptr;
+    }
+
+    // the message serialized in `serial': a LogPackageView taking the buffer for UPDATE_LOG,
+    // the usual class for anything else
+    CoreMessage* viewMessage(PooledBuffer& serial, size_t size)
+    {
+        CoreMessage* msg = LogPackageView::Parse(serial, size);
+        if (msg == nullptr) {
+            msg = CoreMessage::parseFromArray(serial.get(), size);
+        }
+        return msg;
+    }
+
+    // the messages of a serialized coreBatch, each decoded by viewMessage() from its own copy
+    bool viewBatch(const char* serial, size_t size, std::deque<CoreMessage*>& out)
+    {
+        if (size > INT_MAX) {
+            return false;
+        }
+        CodedInputStream in(reinterpret_cast<const uint8_t*>(serial), static_cast<int>(size));
+        std::string_view record;
+        uint32_t tag;
+        while ((tag = in.ReadTag()) != 0) {
+            if (!isString(tag, coreBatch::kMessagesFieldNumber)) {
+                if (!WireFormatLite::SkipField(&in, tag)) {
+                    return false;
+                }
+                continue;
+            }
+            if (!readView(in, record)) {
+                return false;
+            }
+            PooledBuffer copy(AcquireBuffer(record.size()));
+            memcpy(copy.get(), record.data(), record.size());
+            if (!pushMessage(viewMessage(copy, record.size()), out)) {
+                return false;
+            }
+        }
+        return in.ConsumedEntireMessage();
+    }
+
+    // frames decoded in place start at any offset of the read buffer, so the header words are
+    // not necessarily aligned
+    uint32_t headerWord(const char* header, int index)
+    {
+        uint32_t v;
+        memcpy(&v, header + index * 4, sizeof v);
+        return ntohl(v);
+    }
+
+    // scratch buffer holding serialized messages on this thread, shared by the encoder and the
+    // decoder; it only grows.
+    char* serialScratch(size_t size)
+    {
+        thread_local std::vector<char> scratch;
+        if (scratch.size() < size) {
+            scratch.resize(size);
+        }
+        return scratch.data();
+    }
+
+    // serializes `msg' and puts it into a pooled frame built per `option'. `flags' are OR-ed
+    // into the frame info.
+    bool encodeFrame(const google::protobuf::MessageLite& msg,
+                     uint32_t flags,
+                     const FrameOption& option,
+                     FrameStatistics* stats,
+                     char** ptr,
+                     size_t* size)
+    {
+        char *serialBuffer, *pkgBuffer, *payload;
+        size_t serialSize, compressSize, pkgSize;
+        bool serialStatus;
+        Codec codec = option.codec;
+
+        // serialize into the per-thread scratch buffer, then compress straight into the
+        // payload area of the frame, so every message costs exactly one allocation and, when
+        // compression pays off, no payload copy at all.
+        serialSize = msg.ByteSizeLong();
+        serialBuffer = serialScratch(serialSize);
+        serialStatus = msg.SerializeToArray(serialBuffer, serialSize);
+
+        if (serialSize < COMPRESS_MIN_SIZE) {
+            codec = Codec::none;
+        }
+
+        const size_t headerSize = PACKAGE_FIXED_HEADER_SIZE + DigestSize(option.checksum);
+
+        uint8_t dictionary = option.dictionary;
+        if (dictionary != 0
+            && (!CodecUsesDictionary(codec) || GetDictionary(dictionary) == nullptr)) {
+            dictionary = 0;
+        }
+
+        compressSize = std::max(CompressSizeBound(codec, serialSize), serialSize);
+        pkgBuffer = AcquireBuffer(headerSize + compressSize);
+        payload = pkgBuffer + headerSize;
+
+        if (codec != Codec::none
+            && (!Compress(codec,
+                          option.level,
+                          payload,
+                          &compressSize,
+                          serialBuffer,
+                          serialSize,
+                          dictionary)
+                || compressSize >= serialSize)) {
+            codec = Codec::none;
+        }
+
+        if (codec == Codec::none) {
+            compressSize = serialSize;
+            dictionary = 0;
+            memcpy(payload, serialBuffer, serialSize);
+        }
+        pkgSize = headerSize + compressSize;
+
+        uint32_t info = static_cast<uint32_t>(codec)
+                        | static_cast<uint32_t>(option.checksum) << 8
+                        | static_cast<uint32_t>(dictionary) << 16 | flags;
+
+        *((uint32_t*)pkgBuffer + 0) = htonl(serialSize);
+        *((uint32_t*)pkgBuffer + 1) = htonl(compressSize);
+        *((uint32_t*)pkgBuffer + 2) = htonl(info);
+        Digest(option.checksum, serialBuffer, serialSize, pkgBuffer + PACKAGE_FIXED_HEADER_SIZE);
+
+        if (stats != nullptr) {
+            stats->Sent(codec, serialSize, pkgSize);
+        }
+
+        *ptr = pkgBuffer;
+        *size = pkgSize;
+
+        return serialStatus;
     }
 }  // namespace
 
@@ -142,72 +473,49 @@ CoreMessage::CoreMessage(const std::string& desc, Operation op)
 CoreMessage::CoreMessage(LogLevel) : _id(nextID()), _op(Operation::UPDATE_LOG) {}
 
 
-bool CoreMessage::toBytes(char** ptr, size_t* size)
+void CoreMessage::buildCore(coreMessage& core, const FrameOption& option)
 {
-    coreMessage core;
-
     core.set_id(Id());
     core.set_op(dispatch(Op()));
-    auto ts = TimeStamp();
-    if (ts.empty()) {
-        getTimeStamp(ts);
-        core.set_timestamp(ts);
-    } else {
-        core.set_timestamp(TimeStamp());
-    }
-    core.set_description(Description());
-    core.set_clientname(CoreMessage::_myClientName);
-    core.set_osversion(CoreMessage::_myOsVersion);
-    core.set_machineid(CoreMessage::_myMachineID);
-
-    buildPBObj(core);
 
-    char *serialBuffer, *compressBuffer, *pkgBuffer;
-    size_t serialSize, compressSize, pkgSize;
-    bool serialStatus, compressStatus;
-
-    serialStatus = compressStatus = false;
-    serialSize = compressSize = pkgSize = 0;
-    serialBuffer = compressBuffer = pkgBuffer = nullptr;
-
-    serialSize = core.ByteSizeLong();
-    serialBuffer = new char[serialSize];
-    serialStatus = core.SerializeToArray(serialBuffer, serialSize);
-
-    const char* dgstBuffer = SHA256(serialBuffer, serialSize);
-    compressStatus = Compress(&compressBuffer, &compressSize, serialBuffer, serialSize);
-    assert(compressStatus);
-
-    if (compressSize < serialSize) {
-        pkgSize = PACKAGE_HEADER_SIZE + compressSize;
-        pkgBuffer = new char[pkgSize];
-
-        *((uint32_t*)pkgBuffer + 0) = htonl(serialSize);
-        *((uint32_t*)pkgBuffer + 1) = htonl(compressSize);
-
-        memmove(pkgBuffer + 8, dgstBuffer, 32);
-        memmove(pkgBuffer + PACKAGE_HEADER_SIZE, compressBuffer, compressSize);
+    // within a session the server already knows who we are; CONNECT always says it again
+    if (option.session != 0 && Op() != Operation::CONNECT) {
+        core.set_session(option.session);
+        if (Op() == Operation::REFUSE) {
+            core.set_description(Description());
+        }
     } else {
-        pkgSize = PACKAGE_HEADER_SIZE + serialSize;
-        pkgBuffer = new char[pkgSize];
-
-        *((uint32_t*)pkgBuffer + 0) = htonl(serialSize);
-        *((uint32_t*)pkgBuffer + 1) = htonl(serialSize);
-
-        memmove(pkgBuffer + 8, dgstBuffer, 32);
-        memmove(pkgBuffer + PACKAGE_HEADER_SIZE, serialBuffer, serialSize);
+        if (TimeStamp().empty()) {
+            getTimeStamp(*core.mutable_timestamp());
+        } else {
+            core.set_timestamp(TimeStamp());
+        }
+        core.set_description(Description());
+        core.set_clientname(CoreMessage::_myClientName);
+        core.set_osversion(CoreMessage::_myOsVersion);
+        core.set_machineid(CoreMessage::_myMachineID);
     }
-    delete[] compressBuffer;
-    delete[] serialBuffer;
-    delete[] dgstBuffer;
 
-    *ptr = pkgBuffer;
-    *size = pkgSize;
+    buildPBObj(core);
+}
 
-    return serialStatus;
+bool CoreMessage::toBytes(char** ptr,
+                          size_t* size,
+                          const FrameOption& option,
+                          FrameStatistics* stats)
+{
+    coreMessage core;
+    buildCore(core, option);
+    return encodeFrame(core, 0, option, stats, ptr, size);
 }
 
 CoreMessage* CoreMessage::BuildObj(const coreMessage& core)
+{
+    coreMessage copy(core);
+    return BuildObj(std::move(copy));
+}
+
+CoreMessage* CoreMessage::BuildObj(coreMessage&& core)
 {
     CoreMessage* msg = nullptr;
 
@@ -217,11 +525,11 @@ CoreMessage* CoreMessage::BuildObj(const coreMessage& core)
             int size = core.log_size();
             _msg->reserve(size);
             for (int i = 0; i < size; i++) {
-                const auto& levt = core.log(i);
-                Event e(levt.xmleventmessage(),
-                        levt.raweventmessage(),
-                        levt.scope(),
-                        levt.timestamp(),
+                auto& levt = *core.mutable_log(i);
+                Event e(std::move(*levt.mutable_xmleventmessage()),
+                        std::move(*levt.mutable_raweventmessage()),
+                        std::move(*levt.mutable_scope()),
+                        std::move(*levt.mutable_timestamp()),
                         levt.level(),
                         levt.recordid());
 
@@ -236,24 +544,48 @@ CoreMessage* CoreMessage::BuildObj(const coreMessage& core)
             msg = new ReturnLastEventPackage(core.lastevent());
         } break;
         case coreMessage_Operation_ACCEPT_LAST_EVENT: {
-            msg = new AcceptLastEventPackage(core.lastevent());
+            msg = new AcceptLastEventPackage(core.lastevent(), core.acceptid());
+        } break;
+        case coreMessage_Operation_REFUSE: {
+            msg = new RefusePackage(core.refuseid());
+        } break;
+        case coreMessage_Operation_HEARTBEAT: {
+            msg = new HeartbeatPackage;
         } break;
         case coreMessage_Operation_CONNECT: {
-            msg = new ConnectPackage;
+            auto cp = new ConnectPackage;
+            const auto& option = core.option();
+            cp->_codecs = option.codecs();
+            cp->_checksums = option.checksums();
+            cp->_dictionaries.clear();
+            for (const auto& d : option.dictionaries()) {
+                cp->_dictionaries.push_back({static_cast<uint8_t>(d.id()), d.checksum()});
+            }
+            cp->_sessions = option.sessions();
+            cp->_batches = option.batches();
+            cp->_heartbeats = option.heartbeats();
+            cp->_option = FrameOption(static_cast<Codec>(option.codec()),
+                                      option.codeclevel(),
+                                      static_cast<Checksum>(option.checksum()),
+                                      static_cast<uint8_t>(option.dictionary()));
+            cp->_option.session = core.session();
+            cp->_option.window = option.window();
+            msg = cp;
             break;
         }
         default:
-            assert(false);
+            // an operation this side does not know, the decoder counts the frame as an error
             break;
     }
 
     if (msg != nullptr) {
         msg->_id = core.id() == -1 ? nextID() : core.id();
-        msg->_description = core.description();
-        msg->_clientName = core.clientname();
-        msg->_osVersion = core.osversion();
-        msg->_timeStamp = core.timestamp();
-        msg->_machineID = core.machineid();
+        msg->_session = core.session();
+        msg->_description = std::move(*core.mutable_description());
+        msg->_clientName = std::move(*core.mutable_clientname());
+        msg->_osVersion = std::move(*core.mutable_osversion());
+        msg->_timeStamp = std::move(*core.mutable_timestamp());
+        msg->_machineID = std::move(*core.mutable_machineid());
         msg->_osType = core.os() == coreMessage_osType_windows_os ? protobuf::OsType::os_windows
                                                                   : protobuf::OsType::os_linux;
     }
@@ -262,26 +594,137 @@ CoreMessage* CoreMessage::BuildObj(const coreMessage& core)
 
 CoreMessage* CoreMessage::parseFromIStream(std::istream* is)
 {
-    coreMessage core;
-    bool ret = core.ParseFromIstream(is);
+    ArenaMessage core;
+    bool ret = core->ParseFromIstream(is);
     if (ret) {
-        return BuildObj(core);
+        return BuildObj(std::move(*core));
     } else {
         return nullptr;
     }
 }
 
-CoreMessage* CoreMessage::parseFromArray(char* data, size_t size)
+CoreMessage* CoreMessage::parseFromArray(const char* data, size_t size)
 {
-    coreMessage core;
-    bool ret = core.ParseFromArray(data, size);
+    ArenaMessage core;
+    bool ret = core->ParseFromArray(data, size);
     if (ret) {
-        return BuildObj(core);
+        return BuildObj(std::move(*core));
     } else {
         return nullptr;
     }
 }
 
+LogPackageView* LogPackageView::Parse(PooledBuffer& buffer, size_t size)
+{
+    if (size > INT_MAX) {
+        return nullptr;
+    }
+
+    // one pass checks every event, so iterating over them later cannot fail
+    CodedInputStream in(reinterpret_cast<const uint8_t*>(buffer.get()), static_cast<int>(size));
+    uint32_t id = 0, op = 0, os = 0, needAccept = 0, session = 0;
+    std::string_view clientName, osVersion, timeStamp, description, machineID, record;
+    size_t count = 0;
+    EventView last;
+
+    uint32_t tag;
+    while ((tag = in.ReadTag()) != 0) {
+        bool ok;
+        if (isString(tag, coreMessage::kLogFieldNumber)) {
+            EventView evt;
+            ok = readView(in, record) && decodeEvent(record, evt);
+            count++;
+            last = evt;
+        } else if (isVarint(tag, coreMessage::kIdFieldNumber)) {
+            ok = in.ReadVarint32(&id);
+        } else if (isVarint(tag, coreMessage::kOpFieldNumber)) {
+            ok = in.ReadVarint32(&op);
+        } else if (isVarint(tag, coreMessage::kOsFieldNumber)) {
+            ok = in.ReadVarint32(&os);
+        } else if (isVarint(tag, coreMessage::kLogNeedAcceptFieldNumber)) {
+            ok = in.ReadVarint32(&needAccept);
+        } else if (isVarint(tag, coreMessage::kSessionFieldNumber)) {
+            ok = in.ReadVarint32(&session);
+        } else if (isString(tag, coreMessage::kClientNameFieldNumber)) {
+            ok = readView(in, clientName);
+        } else if (isString(tag, coreMessage::kOsVersionFieldNumber)) {
+            ok = readView(in, osVersion);
+        } else if (isString(tag, coreMessage::kTimeStampFieldNumber)) {
+            ok = readView(in, timeStamp);
+        } else if (isString(tag, coreMessage::kDescriptionFieldNumber)) {
+            ok = readView(in, description);
+        } else if (isString(tag, coreMessage::kMachineIDFieldNumber)) {
+            ok = readView(in, machineID);
+        } else {
+            ok = WireFormatLite::SkipField(&in, tag);
+        }
+        if (!ok) {
+            return nullptr;
+        }
+    }
+    if (!in.ConsumedEntireMessage() || op != coreMessage_Operation_UPDATE_LOG) {
+        return nullptr;
+    }
+
+    auto view = new LogPackageView(std::move(buffer), size);
+    view->_count = count;
+    view->_last = last;
+    view->_needAccept = needAccept != 0;
+    view->_id = static_cast<int32_t>(id) == -1 ? nextID() : static_cast<int32_t>(id);
+    view->_session = session;
+    view->_description = description;
+    view->_clientName = clientName;
+    view->_osVersion = osVersion;
+    view->_timeStamp = timeStamp;
+    view->_machineID = machineID;
+    view->_osType = os == coreMessage_osType_windows_os ? protobuf::OsType::os_windows
+                                                        : protobuf::OsType::os_linux;
+    return view;
+}
+
+void LogPackageView::const_iterator::next()
+{
+    // the view checked the whole message, so anything unexpected here is the end
+    std::string_view record;
+    const char* base = _next;
+    CodedInputStream in(reinterpret_cast<const uint8_t*>(base), static_cast<int>(_end - base));
+    for (;;) {
+        const char* pos = base + in.CurrentPosition();
+        uint32_t tag = in.ReadTag();
+        if (tag == 0) {
+            break;
+        }
+        if (!isString(tag, coreMessage::kLogFieldNumber)) {
+            if (!WireFormatLite::SkipField(&in, tag)) {
+                break;
+            }
+            continue;
+        }
+        if (!readView(in, record) || !decodeEvent(record, _event)) {
+            break;
+        }
+        _pos = pos;
+        _next = base + in.CurrentPosition();
+        return;
+    }
+    _pos = _next = _end;
+}
+
+void LogPackageView::buildPBObj(coreMessage& obj)
+{
+    obj.mutable_log()->Reserve(static_cast<int>(_count));
+    for (const auto& evt : *this) {
+        auto l = obj.add_log();
+        l->set_scope(evt.provider.data(), evt.provider.size());
+        l->set_raweventmessage(evt.format.data(), evt.format.size());
+        l->set_timestamp(evt.timeStamp.data(), evt.timeStamp.size());
+        l->set_xmleventmessage(evt.xml.data(), evt.xml.size());
+        l->set_level(static_cast<coreMessage_logLevel>(evt.level));
+        l->set_recordid(evt.rid);
+    }
+    obj.set_logneedaccept(_needAccept);
+}
+
 std::ostream& protobuf::operator<<(std::ostream& ios, const CoreMessage& core)
 {
     ios << "CoreMessage: id: " << core.Id() << "\t"
@@ -352,110 +795,529 @@ void ReturnLastEventPackage::buildPBObj(coreMessage& msg)
 void AcceptLastEventPackage::buildPBObj(coreMessage& msg)
 {
     msg.set_lastevent(_lEID);
+    msg.set_acceptid(_acceptedID);
+}
+
+void ProtobufPacketDecoder::ProtobufPacketEncoder(char** buf, size_t& size, CoreMessage& msg)
+{
+    msg.toBytes(buf, &size);
+}
+
+bool ProtobufPacketDecoder::ProtobufPacketEncoder(char** buf,
+                                                  size_t& size,
+                                                  const std::vector<CoreMessage*>& msgs,
+                                                  const FrameOption& option,
+                                                  FrameStatistics* stats)
+{
+    FrameBatch batch;
+    for (auto m : msgs) {
+        batch.Add(*m, option);
+    }
+    return batch.Encode(buf, &size, option, stats);
+}
+
+void FrameBatch::Add(CoreMessage& msg, const FrameOption& option)
+{
+    msg.buildCore(*_batch.add_messages(), option);
 }
 
-void ProtobufPacketDecoder::parseHeader(char* data, size_t size)
+bool FrameBatch::Encode(char** ptr,
+                        size_t* size,
+                        const FrameOption& option,
+                        FrameStatistics* stats)
 {
-    auto _size = size;
-    auto _data = data;
-    if (headerSize < PACKAGE_HEADER_SIZE) {
-        int c = 0;
-        for (; 0 < (PACKAGE_HEADER_SIZE - headerSize) && _size > 0;
-             c++, _size--, headerSize++, _data++) {
-            header_buffer[headerSize] = data[c];
+    bool ret;
+    if (option.batch && _batch.messages_size() > 1) {
+        ret = encodeFrame(_batch, PACKAGE_BATCH_FLAG, option, stats, ptr, size);
+    } else if (_batch.messages_size() == 1) {
+        ret = encodeFrame(_batch.messages(0), 0, option, stats, ptr, size);
+    } else {
+        // the peer only takes single frames: one after the other in the same buffer
+        std::vector<std::pair<char*, size_t>> frames;
+        size_t total = 0;
+        ret = true;
+        for (const auto& m : _batch.messages()) {
+            char* f;
+            size_t s;
+            ret = encodeFrame(m, 0, option, stats, &f, &s) && ret;
+            frames.emplace_back(f, s);
+            total += s;
         }
-        if (_size <= 0) {
-            return;
+        *ptr = AcquireBuffer(total);
+        *size = total;
+        size_t offset = 0;
+        for (const auto& f : frames) {
+            memcpy(*ptr + offset, f.first, f.second);
+            offset += f.second;
+            ReleaseBuffer(f.first);
         }
     }
-    if (headerSize == PACKAGE_HEADER_SIZE) {
-        if (compressSize == 0) {
-            compressSize = remainSize = htonl(*((uint32_t*)header_buffer + 1));
-            serialSize = htonl(*((uint32_t*)header_buffer + 0));
+    _batch.Clear();
+    return ret;
+}
 
-            _read(_data, _size);
-        } else {
-            assert(false);
+FrameInputStream::FrameInputStream(Codec codec,
+                                   uint8_t dictionary,
+                                   DigestContext& digest,
+                                   const Segment* segments,
+                                   size_t count,
+                                   size_t serialSize)
+    : _segments(segments),
+      _segmentCount(count),
+      _segment(0),
+      _offset(0),
+      _codec(codec),
+      _digest(digest),
+      _serialSize(serialSize),
+      _produced(0),
+      _count(0),
+      _block(nullptr),
+      _blockSize(0),
+      _backup(0),
+      _failed(false)
+{
+    _failed = !_decompressor.Reset(codec, dictionary);
+}
+
+bool FrameInputStream::produce()
+{
+    // skip the segments already consumed
+    while (_segment < _segmentCount && _offset == _segments[_segment].size) {
+        _segment++;
+        _offset = 0;
+    }
+
+    size_t want = std::min<size_t>(_serialSize - _produced, INT_MAX);
+
+    if (_codec == Codec::none) {
+        // uncompressed payloads are handed out where they are
+        if (_segment == _segmentCount) {
+            return false;
+        }
+        _block = _segments[_segment].data + _offset;
+        _blockSize = std::min(want, _segments[_segment].size - _offset);
+        _offset += _blockSize;
+        return true;
+    }
+
+    thread_local char block[FRAME_STREAM_BLOCK_SIZE];
+    want = std::min(want, FRAME_STREAM_BLOCK_SIZE);
+
+    // feed segments until the decompressor has some output; the payload may end in the middle
+    // of a block, so stop at the first non-empty one.
+    size_t out = 0;
+    while (out == 0) {
+        if (_segment == _segmentCount || _decompressor.Finished()) {
+            return false;
+        }
+        const char* in = _segments[_segment].data + _offset;
+        size_t inSize = _segments[_segment].size - _offset;
+        size_t before = inSize;
+        out = want;
+        if (!_decompressor.Decompress(&in, &inSize, block, &out)
+            || (out == 0 && inSize == before && !_decompressor.Finished())) {
+            return false;
+        }
+        _offset = _segments[_segment].size - inSize;
+        if (inSize == 0) {
+            _segment++;
+            _offset = 0;
         }
     }
+    _block = block;
+    _blockSize = out;
+    return true;
 }
 
-void ProtobufPacketDecoder::ProtobufPacketEncoder(char** buf, size_t& size, CoreMessage& msg)
+bool FrameInputStream::Next(const void** data, int* size)
 {
-    msg.toBytes(buf, &size);
+    if (_backup > 0) {
+        *data = _block + _blockSize - _backup;
+        *size = static_cast<int>(_backup);
+        _count += _backup;
+        _backup = 0;
+        return true;
+    }
+
+    if (_failed || _produced == _serialSize) {
+        return false;
+    }
+    if (!produce()) {
+        _failed = true;
+        return false;
+    }
+
+    // every byte is hashed exactly once, when it is produced; bytes handed out again after
+    // BackUp() were already counted.
+    _digest.Update(_block, _blockSize);
+    _produced += _blockSize;
+    _count += _blockSize;
+
+    *data = _block;
+    *size = static_cast<int>(_blockSize);
+    return true;
 }
 
-CoreMessage* ProtobufPacketDecoder::read(void* data, size_t size)
+void FrameInputStream::BackUp(int count)
 {
-    std::lock_guard<std::mutex> lock(this->_mutex);
-    return _read(data, size);
+    assert(count >= 0 && static_cast<size_t>(count) <= _blockSize);
+    _backup = count;
+    _count -= count;
 }
 
-CoreMessage* ProtobufPacketDecoder::_read(void* data, size_t size)
+bool FrameInputStream::Skip(int count)
 {
-    CoreMessage* ret = nullptr;
+    const void* data;
+    int size;
+    while (count > 0) {
+        if (!Next(&data, &size)) {
+            return false;
+        }
+        if (size > count) {
+            BackUp(size - count);
+            size = count;
+        }
+        count -= size;
+    }
+    return true;
+}
 
-    char* buf = nullptr;
+int64_t FrameInputStream::ByteCount() const
+{
+    return _count;
+}
 
-    if (compressSize != 0) {
-        if (remainSize <= size) {
-            buf = new char[compressSize];
+bool FrameInputStream::Finish()
+{
+    if (_failed || _produced != _serialSize) {
+        return false;
+    }
 
-            _buf.read(buf, compressSize - remainSize);
-            assert(_buf.gcount() == compressSize - remainSize);
+    if (_codec != Codec::none) {
+        // the end of the compressed stream may still be in the input (zlib's adler32, the
+        // zstd and lz4 epilogues); decoding it must not produce any more bytes.
+        char extra;
+        while (!_decompressor.Finished() && _segment < _segmentCount) {
+            const char* in = _segments[_segment].data + _offset;
+            size_t inSize = _segments[_segment].size - _offset;
+            size_t out = 1;
+            if (!_decompressor.Decompress(&in, &inSize, &extra, &out) || out != 0) {
+                return false;
+            }
+            _offset = _segments[_segment].size - inSize;
+            if (inSize == 0) {
+                _segment++;
+                _offset = 0;
+            } else if (!_decompressor.Finished()) {
+                // no progress on input that is left
+                return false;
+            }
+        }
+        if (!_decompressor.Finished()) {
+            return false;
+        }
+    }
 
-            memcpy(buf + compressSize - remainSize, data, remainSize);
+    while (_segment < _segmentCount && _offset == _segments[_segment].size) {
+        _segment++;
+        _offset = 0;
+    }
+    return _segment == _segmentCount;
+}
 
-            // here, `buf' contains all data received from remote.
+ChunkChain::~ChunkChain()
+{
+    clear();
+}
 
-            const char* dgst;
+void ChunkChain::append(const char* p, size_t s)
+{
+    while (s > 0) {
+        size_t used = _size % CHUNK_SIZE;
+        if (used == 0) {
+            _chunks.push_back(AcquireBuffer(CHUNK_SIZE));
+        }
+        size_t take = std::min(s, CHUNK_SIZE - used);
+        memcpy(_chunks.back() + used, p, take);
+        p += take;
+        s -= take;
+        _size += take;
+    }
+}
 
-            if (serialSize == compressSize) {
-                //donot de-compress the `buf'
+void ChunkChain::segments(std::vector<FrameInputStream::Segment>& out) const
+{
+    size_t left = _size;
+    for (auto c : _chunks) {
+        size_t n = std::min(left, CHUNK_SIZE);
+        out.push_back({c, n});
+        left -= n;
+    }
+}
 
-                dgst = SHA256(buf, serialSize);
-                assert(memcmp((char*)header_buffer + 8, dgst, 32) == 0);
+void ChunkChain::clear()
+{
+    for (auto c : _chunks) {
+        ReleaseBuffer(c);
+    }
+    _chunks.clear();
+    _size = 0;
+}
 
-                ret = CoreMessage::parseFromArray(buf, serialSize);
-            } else {
-                auto uncompressBuffer = new char[(uint64_t)serialSize + 1];
-                size_t uncompressSize = serialSize;
-                DeCompress(uncompressBuffer, &uncompressSize, buf, compressSize);
-
-                dgst = SHA256(uncompressBuffer, uncompressSize);
-                assert(memcmp((char*)header_buffer + 8, dgst, 32) == 0);
-                ret = CoreMessage::parseFromArray(uncompressBuffer, uncompressSize);
-                delete[] uncompressBuffer;
-            }
+size_t ProtobufPacketDecoder::headerSize(const char* header)
+{
+    auto checksum = static_cast<Checksum>((headerWord(header, 2) >> 8) & 0xff);
+    return PACKAGE_FIXED_HEADER_SIZE + DigestSize(checksum);
+}
 
-            _vec.push_back(ret);
-            assert(ret != nullptr);
-            compressSize = headerSize = 0;
-
-            delete[] dgst;
-            delete[] buf;
-            if (size >= remainSize) {
-                size -= remainSize;
-                char* p = (char*)data + remainSize;
-                headerSize = remainSize = compressSize = 0;
-                parseHeader(p, size - remainSize);
-            } else {
-                assert(false);
+size_t ProtobufPacketDecoder::payloadSize(const char* header)
+{
+    return headerWord(header, 1);
+}
+
+bool ProtobufPacketDecoder::oversized(const char* header) const
+{
+    return headerWord(header, 0) > _maxFrameSize || headerWord(header, 1) > _maxFrameSize;
+}
+
+void ProtobufPacketDecoder::decodeFrame(const char* header)
+{
+    uint32_t serialSize = headerWord(header, 0);
+    uint32_t compressSize = headerWord(header, 1);
+    uint32_t info = headerWord(header, 2);
+
+    uint32_t c = info & 0xff, sum = (info >> 8) & 0xff, dictionary = (info >> 16) & 0xff;
+    if (c >= CODEC_COUNT || (SupportedCodecs() & (1u << c)) == 0 || sum >= CHECKSUM_COUNT
+        || (SupportedChecksums() & (1u << sum)) == 0
+        || (dictionary != 0
+            && (GetDictionary(dictionary) == nullptr
+                || !CodecUsesDictionary(static_cast<Codec>(c))))) {
+        // the peer ignored the negotiated option; nothing sensible can be done with the frame.
+        _errors++;
+        return;
+    }
+    auto codec = static_cast<Codec>(c);
+    auto checksum = static_cast<Checksum>(sum);
+
+    // the message is parsed straight out of the payload segments. The digest is only known
+    // once every byte has been produced, so the parsed message is checked afterwards.
+    _digest.Reset(checksum);
+    FrameInputStream in(
+        codec, dictionary, _digest, _segments.data(), _segments.size(), serialSize);
+
+    auto verified = [&]() {
+        char dgst[PACKAGE_MAX_DIGEST_SIZE];
+        _digest.Final(dgst);
+        return memcmp(header + PACKAGE_FIXED_HEADER_SIZE, dgst, DigestSize(checksum)) == 0;
+    };
+
+    // a batch frame yields all of its messages, any other frame exactly one
+    const bool batch = (info & PACKAGE_BATCH_FLAG) != 0;
+    bool decoded = false;
+    if (_views) {
+        // a view reads the events in place, so the serialized message is kept in one piece
+        PooledBuffer serial(AcquireBuffer(serialSize));
+        bool parsed = readSerial(in, serial.get(), serialSize) && in.Finish();
+        if (parsed && verified()) {
+            decoded = batch ? viewBatch(serial.get(), serialSize, _vec)
+                            : pushMessage(viewMessage(serial, serialSize), _vec);
+        }
+    } else if (batch) {
+        ArenaObject<coreBatch> msgs;
+        bool parsed = msgs->ParseFromZeroCopyStream(&in) && in.Finish();
+        if (parsed && verified()) {
+            decoded = true;
+            for (auto& m : *msgs->mutable_messages()) {
+                decoded = pushMessage(CoreMessage::BuildObj(std::move(m)), _vec) && decoded;
             }
-        } else {
-            _buf.write((char*)data, size);
-            remainSize -= size;
-            assert(remainSize <= compressSize);
         }
     } else {
-        parseHeader((char*)data, size);
+        ArenaMessage core;
+        bool parsed = core->ParseFromZeroCopyStream(&in) && in.Finish();
+        if (parsed && verified()) {
+            decoded = pushMessage(CoreMessage::BuildObj(std::move(*core)), _vec);
+        }
+    }
+    if (!decoded) {
+        _errors++;
+    } else if (_stats != nullptr) {
+        _stats->Received(codec, serialSize, headerSize(header) + compressSize);
     }
+}
 
-    assert(_buf);
-    return ret;
+size_t ProtobufPacketDecoder::read(const void* data, size_t size)
+{
+    std::lock_guard<std::mutex> lock(this->_mutex);
+
+    auto before = _vec.size();
+    auto p = reinterpret_cast<const char*>(data);
+
+    // a frame too large leaves no way to find the next one
+    auto refuse = [this]() {
+        _errors++;
+        _failed = true;
+        _headerFill = 0;
+        _payload.clear();
+    };
+
+    while (size > 0 && !_failed) {
+        if (_headerFill == 0 && size >= PACKAGE_FIXED_HEADER_SIZE && oversized(p)) {
+            refuse();
+            break;
+        }
+        // whole frames are decoded straight from the caller's memory
+        if (_headerFill == 0 && size >= PACKAGE_FIXED_HEADER_SIZE && size >= headerSize(p)
+            && size - headerSize(p) >= payloadSize(p)) {
+            auto hs = headerSize(p), ps = payloadSize(p);
+            _segments.assign(1, {p + hs, ps});
+            decodeFrame(p);
+            p += hs + ps;
+            size -= hs + ps;
+            continue;
+        }
+
+        // the header is collected first; its fixed part tells how long the digest is
+        size_t need = PACKAGE_FIXED_HEADER_SIZE;
+        if (_headerFill >= PACKAGE_FIXED_HEADER_SIZE) {
+            need = headerSize(_header);
+        }
+        if (_headerFill < need) {
+            size_t take = std::min(size, need - _headerFill);
+            memcpy(_header + _headerFill, p, take);
+            _headerFill += take;
+            p += take;
+            size -= take;
+            if (_headerFill < PACKAGE_FIXED_HEADER_SIZE || _headerFill < headerSize(_header)) {
+                continue;
+            }
+        }
+        if (oversized(_header)) {
+            refuse();
+            break;
+        }
+
+        // then the payload: buffered in chunks until the rest of it is in this read, which is
+        // used in place as the last segment.
+        size_t rest = payloadSize(_header) - _payload.size();
+        if (size < rest) {
+            _payload.append(p, size);
+            size = 0;
+            break;
+        }
+        _segments.clear();
+        _payload.segments(_segments);
+        if (rest > 0) {
+            _segments.push_back({p, rest});
+        }
+        decodeFrame(_header);
+        p += rest;
+        size -= rest;
+        _headerFill = 0;
+        _payload.clear();
+    }
+
+    return _vec.size() - before;
+}
+
+protobuf::ConnectPackage::ConnectPackage()
+    : CoreMessage(nextID(), "Connect"),
+      _codecs(SupportedCodecs()),
+      _checksums(SupportedChecksums()),
+      _dictionaries(LoadedDictionaries()),
+      _sessions(true),
+      _batches(true),
+      _heartbeats(true)
+{
+    Op(Operation::CONNECT);
 }
 
-protobuf::ConnectPackage::ConnectPackage() : CoreMessage(nextID(), "Connect")
+protobuf::ConnectPackage::ConnectPackage(const FrameOption& option)
+    : CoreMessage(nextID(), "Connect"),
+      _codecs(SupportedCodecs()),
+      _checksums(SupportedChecksums()),
+      _dictionaries(LoadedDictionaries()),
+      _sessions(true),
+      _batches(true),
+      _heartbeats(true),
+      _option(option)
 {
     Op(Operation::CONNECT);
 }
+
+void ConnectPackage::buildPBObj(coreMessage& msg)
+{
+    auto option = msg.mutable_option();
+    option->set_codecs(_codecs);
+    option->set_codec(static_cast<uint32_t>(_option.codec));
+    option->set_codeclevel(_option.level);
+    option->set_checksums(_checksums);
+    option->set_checksum(static_cast<uint32_t>(_option.checksum));
+    for (const auto& d : _dictionaries) {
+        auto info = option->add_dictionaries();
+        info->set_id(d.id);
+        info->set_checksum(d.checksum);
+    }
+    option->set_dictionary(_option.dictionary);
+    option->set_sessions(_sessions);
+    option->set_batches(_batches);
+    option->set_heartbeats(_heartbeats);
+    option->set_window(_option.window);
+    msg.set_session(_option.session);
+}
+
+FrameOption ConnectPackage::Negotiate(const FrameOption& preferred) const
+{
+    FrameOption ret;
+    uint32_t codecs = _codecs & SupportedCodecs();
+    uint32_t checksums = _checksums & SupportedChecksums();
+
+    if (codecs & (1u << static_cast<int>(preferred.codec))) {
+        ret.codec = preferred.codec;
+        ret.level = preferred.level;
+    } else if ((codecs & (1u << static_cast<int>(Codec::zlib))) == 0) {
+        ret.codec = Codec::none;
+    }
+
+    if (checksums & (1u << static_cast<int>(preferred.checksum))) {
+        ret.checksum = preferred.checksum;
+    }
+
+    // a dictionary is only used if the peer holds exactly the content we do
+    auto local = GetDictionary(preferred.dictionary);
+    if (preferred.dictionary != 0 && local != nullptr && CodecUsesDictionary(ret.codec)) {
+        uint32_t crc = Crc32c(local->data(), local->size());
+        for (const auto& d : _dictionaries) {
+            if (d.id == preferred.dictionary && d.checksum == crc) {
+                ret.dictionary = d.id;
+                break;
+            }
+        }
+    }
+
+    if (_sessions) {
+        ret.session = preferred.session;
+    }
+    ret.batch = preferred.batch && _batches;
+    // agents that predate the window send none and wait for every package
+    ret.window = std::max(1u, std::min(preferred.window, _option.window));
+    return ret;
+}
+
+std::ostream& protobuf::operator<<(std::ostream& ios, const FrameStatistics& stats)
+{
+    auto print = [&ios](const char* dir, const FrameStatistics::Counter* counter) {
+        for (int i = 0; i < CODEC_COUNT; i++) {
+            const auto& c = counter[i];
+            if (c.frames == 0) {
+                continue;
+            }
+            uint64_t raw = c.rawBytes, wire = c.wireBytes;
+            ios << dir << " " << CodecName(static_cast<Codec>(i)) << ": " << c.frames
+                << " frames, " << raw << " -> " << wire << " bytes (ratio "
+                << (wire == 0 ? 0.0 : static_cast<double>(raw) / wire) << "). ";
+        }
+    };
+    print("sent", stats._sent);
+    print("received", stats._received);
+    return ios;
+}
@@ -16,6 +16,7 @@
 #endif
 #endif
 #include <clientService.pb.h>
+#include <google/protobuf/io/zero_copy_stream.h>
 
 #if defined __GNUC__ && !defined __clang__
 #pragma GCC diagnostic pop
@@ -30,9 +31,21 @@
 #include <algorithm>
 #include <mutex>
 #include <deque>
-
+#include <cstring>
+#include <atomic>
+#include <ostream>
+#include <memory>
+#include <string_view>
+#include <iterator>
+
+// local time as "YYYY-MM-DD hh:mm:ss.mmm+hh:mm", the offset from UTC last. The text is
+// cached per thread and only formatted again when the millisecond changes.
 void getTimeStamp(std::string&);
 
+// microseconds since the Unix epoch, read from a coarse monotonic clock anchored to the wall
+// clock. For hot paths that need no text.
+int64_t getEpochMicroseconds();
+
 void getOsVersion(std::string&);
 
 void initProtobufLibrary(const std::string& = "");
@@ -51,26 +64,262 @@ namespace protobuf
         RETURN_LAST_EVENT,
         ACCEPT_LAST_EVENT,
         CONNECT,
-        REFUSE
+        REFUSE,
+        HEARTBEAT
     };
 
     enum class LogLevel { fatal, error, warning, info, verbose };
 
     enum class OsType { os_windows, os_linux, os_other };
 
+    // payload compression of a frame. The value is carried in the frame header, so it must
+    // never be renumbered.
+    enum class Codec : uint8_t { none = 0, zlib = 1, lz4 = 2, zstd = 3 };
+
+    static constexpr int CODEC_COUNT = 4;
+
+    // bitmask (1 << Codec) of the codecs compiled into this library
+    uint32_t SupportedCodecs();
+
+    const char* CodecName(Codec);
+
+    bool ParseCodec(const std::string&, Codec&);
+
+    // whether `codec' compresses at `level'; none takes any, as it ignores it
+    bool CodecLevelValid(Codec, int level);
+
+    // integrity check of the serialized message carried in the frame header. Like Codec, the
+    // value is part of the wire format.
+    enum class Checksum : uint8_t { sha256 = 0, crc32c = 1, xxh3 = 2 };
+
+    static constexpr int CHECKSUM_COUNT = 3;
+
+    // bitmask (1 << Checksum) of the checksums compiled into this library
+    uint32_t SupportedChecksums();
+
+    const char* ChecksumName(Checksum);
+
+    bool ParseChecksum(const std::string&, Checksum&);
+
+    // number of digest bytes `Checksum' puts into the frame header
+    size_t DigestSize(Checksum);
+
+    // writes the DigestSize() bytes of the digest of `data' to `out'
+    void Digest(Checksum, const void* data, size_t size, char* out);
+
+    // CRC-32C (Castagnoli), hardware accelerated where the CPU supports it. Pass the previous
+    // result as `crc' to continue a running checksum.
+    uint32_t Crc32c(const void*, size_t, uint32_t crc = 0);
+
+    // incremental form of Digest(), for data that becomes available in pieces
+    class DigestContext
+    {
+        Checksum _checksum;
+        uint32_t _crc;
+        void* _state;
+
+    public:
+        DigestContext() : _checksum(Checksum::crc32c), _crc(0), _state(nullptr) {}
+
+        ~DigestContext();
+
+        DigestContext(const DigestContext&) = delete;
+        DigestContext& operator=(const DigestContext&) = delete;
+
+        void Reset(Checksum);
+
+        void Update(const void*, size_t);
+
+        // writes the DigestSize() bytes of the digest of everything passed to Update() since
+        // the last Reset()
+        void Final(char* out);
+    };
+
+    // shared compression dictionaries, trained offline from captured traffic with dictTrainer.
+    // A frame names its dictionary by a one-byte id (0 is none), so both ends must hold the
+    // same content under the same id; CONNECT compares the CRC-32C of the content before one is
+    // used. zlib takes it as a preset dictionary and zstd as a trained dictionary; lz4 frames
+    // never use one.
+    //
+    // Dictionaries are loaded before any frame is built or decoded and are never unloaded.
+    struct DictionaryInfo {
+        uint8_t id;
+        uint32_t checksum;
+    };
+
+    bool LoadDictionary(uint8_t id, const char* data, size_t size);
+
+    // loads a file written by SaveDictionaryFile(), which records the id; `*id' receives it
+    bool LoadDictionaryFile(const std::string& path, uint8_t* id = nullptr);
+
+    bool SaveDictionaryFile(const std::string& path, uint8_t id, const char* data, size_t size);
+
+    // content of dictionary `id', or nullptr if nothing is loaded under it
+    const std::string* GetDictionary(uint8_t id);
+
+    std::vector<DictionaryInfo> LoadedDictionaries();
+
+    bool CodecUsesDictionary(Codec);
+
+    // buffer pool of frames and serialized messages. Buffers come in power-of-two size classes
+    // from BUFFER_MIN_CLASS to BUFFER_MAX_CLASS bytes, BUFFER_HEADER_SIZE of which are taken by
+    // the pool's own bookkeeping. Each thread caches a few free buffers of every class and
+    // shares the rest through a common depot, so a buffer may be released on any thread.
+    // Larger requests are allocated and freed every time.
+    //
+    // Frames built by toBytes() and FrameBatch::Encode() come from the pool and must be
+    // returned with ReleaseBuffer().
+    static constexpr size_t BUFFER_HEADER_SIZE = 16;
+    static constexpr size_t BUFFER_MIN_CLASS = 256;
+    static constexpr size_t BUFFER_MAX_CLASS = 4 * 1024 * 1024;
+
+    // a buffer holding at least `size' bytes
+    char* AcquireBuffer(size_t size);
+
+    // returns a buffer of AcquireBuffer() to the pool; nullptr is ignored
+    void ReleaseBuffer(char*);
+
+    struct BufferDeleter {
+        void operator()(char* p) const
+        {
+            ReleaseBuffer(p);
+        }
+    };
+
+    using PooledBuffer = std::unique_ptr<char[], BufferDeleter>;
+
+    struct BufferPoolStatistics {
+        // requests served from a cache, and requests that had to allocate
+        uint64_t hits;
+        uint64_t misses;
+        // bytes of the free buffers held by the caches and the depot
+        uint64_t bytesHeld;
+
+        double HitRate() const
+        {
+            return hits + misses == 0 ? 0.0 : static_cast<double>(hits) / (hits + misses);
+        }
+    };
+
+    BufferPoolStatistics GetBufferPoolStatistics();
+
+    std::ostream& operator<<(std::ostream&, const BufferPoolStatistics&);
+
+    // backs buffers of 2 MiB and more with transparent huge pages where the system has them.
+    // Off by default; only affects buffers allocated afterwards.
+    void UseHugePageBuffers(bool);
+
+    // how the frames sent over one connection are built. Both sides start with the default and
+    // switch to the option the server picks in the CONNECT exchange.
+    //
+    // A non-zero session is the id the server assigned to the connection. Frames other than
+    // CONNECT then carry only that id instead of the client's identity and a time stamp.
+    // batch tells whether the peer decodes batch frames. window is the number of UPDATE_LOG
+    // packages the agent may send before the first of them is acknowledged; 1 is stop-and-wait.
+    struct FrameOption {
+        static constexpr int DEFAULT_ZLIB_LEVEL = 6;
+        static constexpr uint32_t DEFAULT_WINDOW = 8;
+
+        Codec codec;
+        int level;
+        Checksum checksum;
+        uint8_t dictionary;
+        uint32_t session;
+        bool batch;
+        uint32_t window;
+
+        FrameOption()
+            : codec(Codec::zlib),
+              level(DEFAULT_ZLIB_LEVEL),
+              checksum(Checksum::crc32c),
+              dictionary(0),
+              session(0),
+              batch(false),
+              window(DEFAULT_WINDOW)
+        {
+        }
+
+        FrameOption(Codec c, int l, Checksum sum = Checksum::crc32c, uint8_t dict = 0)
+            : codec(c),
+              level(l),
+              checksum(sum),
+              dictionary(dict),
+              session(0),
+              batch(false),
+              window(DEFAULT_WINDOW)
+        {
+        }
+    };
+
+    // whether message id `a' was assigned before `b'. Ids wrap around, so they are compared as
+    // serial numbers: correct as long as the two are less than 2^31 ids apart.
+    inline bool MessageIdBefore(int a, int b)
+    {
+        return static_cast<int32_t>(static_cast<uint32_t>(a) - static_cast<uint32_t>(b)) < 0;
+    }
+
+    // per-connection frame counters, split by codec. Updated by the encoder and the decoder,
+    // possibly from different threads.
+    class FrameStatistics
+    {
+        friend std::ostream& operator<<(std::ostream&, const FrameStatistics&);
+
+        struct Counter {
+            std::atomic<uint64_t> frames{0};
+            std::atomic<uint64_t> rawBytes{0};
+            std::atomic<uint64_t> wireBytes{0};
+
+            void add(size_t raw, size_t wire)
+            {
+                frames++;
+                rawBytes += raw;
+                wireBytes += wire;
+            }
+        };
+
+        Counter _sent[CODEC_COUNT];
+        Counter _received[CODEC_COUNT];
+
+    public:
+        void Sent(Codec c, size_t raw, size_t wire)
+        {
+            _sent[static_cast<int>(c)].add(raw, wire);
+        }
+
+        void Received(Codec c, size_t raw, size_t wire)
+        {
+            _received[static_cast<int>(c)].add(raw, wire);
+        }
+
+        uint64_t SentFrames(Codec c) const
+        {
+            return _sent[static_cast<int>(c)].frames;
+        }
+
+        uint64_t ReceivedFrames(Codec c) const
+        {
+            return _received[static_cast<int>(c)].frames;
+        }
+    };
+
     class CoreMessage;
     class LogPackage;
 
     std::ostream& operator<<(std::ostream& ios, const protobuf::CoreMessage&);
     std::ostream& operator<<(std::ostream& ios, const protobuf::LogPackage&);
+    std::ostream& operator<<(std::ostream& ios, const protobuf::FrameStatistics&);
 
     class CoreMessage
     {
+        friend class LogPackageView;
+        friend class FrameBatch;
         friend void ::initProtobufLibrary(const std::string&);
         friend std::ostream& operator<<(std::ostream& ios, const CoreMessage&);
 
         int32_t _id = -1;
 
+        uint32_t _session = 0;
+
         std::string _clientName;
 
         std::string _osVersion;
@@ -105,6 +354,9 @@ namespace protobuf
 
         virtual void buildPBObj(coreMessage&) = 0;
 
+        // the whole message as frames built per `option' carry it
+        void buildCore(coreMessage&, const FrameOption&);
+
         CoreMessage(LogLevel);
 
     public:
@@ -116,12 +368,21 @@ namespace protobuf
 
         CoreMessage(int id, const std::string& desc);
 
-        bool toBytes(char** ptr, size_t* size) ;
+        // builds the frame of this message into a buffer of the pool; release it with
+        // ReleaseBuffer()
+        bool toBytes(char** ptr,
+                     size_t* size,
+                     const FrameOption& = FrameOption(),
+                     FrameStatistics* = nullptr);
 
         static CoreMessage* BuildObj(const coreMessage&);
+
+        // like BuildObj(const coreMessage&), but moves the strings out of `core' instead of
+        // copying them
+        static CoreMessage* BuildObj(coreMessage&&);
         static CoreMessage* parseFromIStream(std::istream*);
 
-        static CoreMessage* parseFromArray(char*, size_t);
+        static CoreMessage* parseFromArray(const char*, size_t);
 
         const std::string& GetClientName() const
         {
@@ -152,6 +413,12 @@ namespace protobuf
         {
             return _id;
         }
+
+        // session id the frame of a received message carried, 0 if it sent its identity
+        uint32_t Session() const
+        {
+            return _session;
+        }
         void Id(int32_t val)
         {
             _id = val;
@@ -198,18 +465,80 @@ namespace protobuf
 
     class ConnectPackage : public CoreMessage
     {
+        friend class CoreMessage;
+
+        uint32_t _codecs;
+        uint32_t _checksums;
+        std::vector<DictionaryInfo> _dictionaries;
+        bool _sessions;
+        bool _batches;
+        bool _heartbeats;
+        FrameOption _option;
+
     public:
         ConnectPackage();
-        virtual void buildPBObj(coreMessage&) {}
+        ConnectPackage(const FrameOption&);
+
+        // codecs the sender of this package is able to decode
+        uint32_t Codecs() const
+        {
+            return _codecs;
+        }
+
+        // checksums the sender of this package is able to verify
+        uint32_t Checksums() const
+        {
+            return _checksums;
+        }
+
+        // dictionaries the sender of this package has loaded
+        const std::vector<DictionaryInfo>& Dictionaries() const
+        {
+            return _dictionaries;
+        }
+
+        // whether the sender of this package understands session ids
+        bool Sessions() const
+        {
+            return _sessions;
+        }
+
+        // whether the sender of this package decodes batch frames
+        bool Batches() const
+        {
+            return _batches;
+        }
+
+        // whether the sender of this package answers HEARTBEAT
+        bool Heartbeats() const
+        {
+            return _heartbeats;
+        }
+
+        const FrameOption& GetFrameOption() const
+        {
+            return _option;
+        }
+
+        // the option both ends use after this CONNECT: the parts of `preferred' the peer can
+        // handle, zlib, CRC-32C, no dictionary, no session and single frames for the rest. The
+        // window is the smaller of both, at least 1.
+        FrameOption Negotiate(const FrameOption& preferred) const;
+
+        virtual void buildPBObj(coreMessage&);
     };
 
+    // acknowledges, cumulatively, the UPDATE_LOG packages of a connection up to `acceptedID'
     class AcceptLastEventPackage : public CoreMessage
     {
         uint32_t _lEID;
+        int _acceptedID;
 
     public:
-        AcceptLastEventPackage(uint32_t lastEID)
-            : CoreMessage("AcceptLastEventPackage", Operation::ACCEPT_LAST_EVENT), _lEID(lastEID)
+        AcceptLastEventPackage(uint32_t lastEID, int acceptedID = 0)
+            : CoreMessage("AcceptLastEventPackage", Operation::ACCEPT_LAST_EVENT),
+              _lEID(lastEID),
+              _acceptedID(acceptedID)
         {
         }
 
@@ -218,6 +547,12 @@ namespace protobuf
             return _lEID;
         }
 
+        // id of the last package stored, 0 if the server did not say
+        int AcceptedID() const
+        {
+            return _acceptedID;
+        }
+
         virtual void buildPBObj(coreMessage& msg) ;
     };
 
@@ -259,6 +594,11 @@ namespace protobuf
         {
             Message("Refuse package");
         }
+
+        int RefusedID() const
+        {
+            return refusedID;
+        }
     };
 
     class QueryLastEventPackage : public CoreMessage
@@ -271,6 +611,65 @@ namespace protobuf
         void buildPBObj(coreMessage&) {}
     };
 
+    // asks the peer whether it is still there; the peer sends one back
+    class HeartbeatPackage : public CoreMessage
+    {
+    public:
+        HeartbeatPackage() : CoreMessage("Heartbeat", Operation::HEARTBEAT) {}
+
+        void buildPBObj(coreMessage&) {}
+    };
+
+    // idle detection of a connection, in seconds of the caller's clock: silent for
+    // `heartbeatInterval' it is sent a heartbeat if it answers them, silent for `idleTimeout'
+    // it is closed. 0 turns either off.
+    struct IdleState {
+        enum class Check { none, heartbeat, close };
+
+        // the second of the last read, whether the peer answers heartbeats and whether it
+        // was sent one since
+        uint64_t lastActive = 0;
+        bool heartbeats = false;
+        bool heartbeatSent = false;
+
+        // a read at `now'. True if that brought the next check forward, as it does after a
+        // heartbeat: the check was only waiting for the idle timeout then, if any.
+        bool Active(uint64_t now)
+        {
+            lastActive = now;
+            bool sooner = heartbeatSent;
+            heartbeatSent = false;
+            return sooner;
+        }
+
+        // the second of the next check, UINT64_MAX for none
+        uint64_t Due(unsigned int idleTimeout, unsigned int heartbeatInterval) const
+        {
+            uint64_t due = UINT64_MAX;
+            if (idleTimeout != 0) {
+                due = lastActive + idleTimeout;
+            }
+            if (heartbeatInterval != 0 && heartbeats && !heartbeatSent) {
+                due = std::min(due, lastActive + heartbeatInterval);
+            }
+            return due;
+        }
+
+        // what is due at `now'; a heartbeat is taken as sent
+        Check Next(uint64_t now, unsigned int idleTimeout, unsigned int heartbeatInterval)
+        {
+            if (idleTimeout != 0 && now - lastActive >= idleTimeout) {
+                return Check::close;
+            }
+            if (heartbeatInterval != 0 && heartbeats && !heartbeatSent
+                && now - lastActive >= heartbeatInterval) {
+                heartbeatSent = true;
+                return Check::heartbeat;
+            }
+            return Check::none;
+        }
+    };
+
     class UpdatePackage : public CoreMessage
     {
         std::string _versionString;
@@ -352,24 +751,25 @@ namespace protobuf
 
         Event() {}
 
-        Event(const std::string& x,
-              const std::string& f,
-              const std::string& p,
-              const std::string& t,
-              LogLevel l,
-              uint32_t r)
-            : xml(x), format(f), timeStamp(t), provider(p), llevel(l), rid(r)
+        // strings are taken by value, so callers handing over temporaries do not copy them
+        Event(std::string x, std::string f, std::string p, std::string t, LogLevel l, uint32_t r)
+            : xml(std::move(x)),
+              format(std::move(f)),
+              timeStamp(std::move(t)),
+              provider(std::move(p)),
+              llevel(l),
+              rid(r)
         {
             level = dispatch(l);
         }
 
-        Event(const std::string& x,
-              const std::string& f,
-              const std::string& p,
-              const std::string& t,
-              uint32_t l,
-              uint32_t r)
-            : xml(x), format(f), timeStamp(t), provider(p), level(l), rid(r)
+        Event(std::string x, std::string f, std::string p, std::string t, uint32_t l, uint32_t r)
+            : xml(std::move(x)),
+              format(std::move(f)),
+              timeStamp(std::move(t)),
+              provider(std::move(p)),
+              level(l),
+              rid(r)
         {
             llevel = dispatch(l);
         }
@@ -432,29 +832,351 @@ namespace protobuf
         }
     };
 
-    static constexpr int PACKAGE_HEADER_SIZE = 4 + 4 + 32;
+    // one event of a LogPackageView. The strings point into the buffer of the view and are only
+    // valid while it lives; level is the value Event::level would hold.
+    struct EventView {
+        std::string_view xml;
+        std::string_view format;
+        std::string_view timeStamp;
+        std::string_view provider;
 
-    class ProtobufPacketDecoder
+        uint32_t level;
+        uint32_t rid;
+    };
+
+    // read-only LogPackage over the serialized message of a frame, for sinks that only stream
+    // the events somewhere else. The view owns that buffer and walks the events in place, so
+    // reading them costs no allocation; the decoder builds one instead of a LogPackage when
+    // asked to with ProtobufPacketDecoder::DecodeLogPackageViews().
+    class LogPackageView : public CoreMessage
     {
-        uint32_t compressSize;
-        uint32_t remainSize;
-        uint32_t serialSize;
-        uint32_t headerSize;
+        PooledBuffer _buffer;
+        size_t _size;
+        size_t _count;
+        bool _needAccept;
+        EventView _last;
+
+        LogPackageView(PooledBuffer buffer, size_t size)
+            : CoreMessage(Operation::UPDATE_LOG),
+              _buffer(std::move(buffer)),
+              _size(size),
+              _count(0),
+              _needAccept(false),
+              _last()
+        {
+        }
 
-        std::deque<CoreMessage*> _vec;
+    public:
+        class const_iterator
+        {
+            const char* _pos;
+            const char* _next;
+            const char* _end;
+            EventView _event;
+
+            void next();
+
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = EventView;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const EventView*;
+            using reference = const EventView&;
+
+            const_iterator(const char* begin, const char* end)
+                : _pos(begin), _next(begin), _end(end), _event()
+            {
+                next();
+            }
+
+            reference operator*() const
+            {
+                return _event;
+            }
+
+            pointer operator->() const
+            {
+                return &_event;
+            }
+
+            const_iterator& operator++()
+            {
+                next();
+                return *this;
+            }
+
+            const_iterator operator++(int)
+            {
+                auto ret = *this;
+                next();
+                return ret;
+            }
+
+            bool operator==(const const_iterator& o) const
+            {
+                return _pos == o._pos;
+            }
+
+            bool operator!=(const const_iterator& o) const
+            {
+                return _pos != o._pos;
+            }
+        };
+
+        // takes the serialized coreMessage `buffer'. Returns nullptr, leaving `buffer' alone, if
+        // it is malformed or not an UPDATE_LOG message.
+        static LogPackageView* Parse(PooledBuffer& buffer, size_t size);
+
+        const_iterator begin() const
+        {
+            return const_iterator(_buffer.get(), _buffer.get() + _size);
+        }
+
+        const_iterator end() const
+        {
+            return const_iterator(_buffer.get() + _size, _buffer.get() + _size);
+        }
+
+        size_t size() const
+        {
+            return _count;
+        }
+
+        bool empty() const
+        {
+            return _count == 0;
+        }
+
+        // the last event of the package; only meaningful if it is not empty
+        const EventView& back() const
+        {
+            return _last;
+        }
+
+        bool NeedAccept() const
+        {
+            return _needAccept;
+        }
+
+        // bytes of the serialized message the events are read from
+        size_t Bytes() const
+        {
+            return _size;
+        }
+
+        virtual void buildPBObj(coreMessage&);
+    };
+
+    // frame header: serialized size, payload size, frame info and the digest of the serialized
+    // message. All integers are in network order. Bits 0-7 of the frame info are the Codec of
+    // the payload, bits 8-15 the Checksum, which decides how many digest bytes follow the fixed
+    // part of the header, bits 16-23 the dictionary id and bit 24 the batch flag; the remaining
+    // bits are reserved and must be zero. The payload of a batch frame is a coreBatch instead of
+    // a coreMessage.
+    static constexpr int PACKAGE_FIXED_HEADER_SIZE = 4 + 4 + 4;
+    static constexpr uint32_t PACKAGE_BATCH_FLAG = 1u << 24;
+    static constexpr int PACKAGE_MAX_DIGEST_SIZE = 32;
+    static constexpr int PACKAGE_HEADER_SIZE = PACKAGE_FIXED_HEADER_SIZE + PACKAGE_MAX_DIGEST_SIZE;
+
+    // largest serialized or payload size a decoder accepts unless told otherwise
+    static constexpr size_t PACKAGE_DEFAULT_MAX_FRAME_SIZE = 64 * 1024 * 1024;
+
+    // messages smaller than this are never worth compressing
+    static constexpr size_t COMPRESS_MIN_SIZE = 128;
+
+    // streaming counterpart of DeCompress(): the payload is fed in whatever pieces it arrived
+    // in and the output is taken in blocks of the caller's size. It runs on the per-thread
+    // codec state, so a thread can only decompress one stream at a time.
+    class StreamDecompressor
+    {
+        Codec _codec;
+        uint8_t _dictionary;
+        bool _finished;
+        void* _ctx;
+
+    public:
+        StreamDecompressor()
+            : _codec(Codec::none), _dictionary(0), _finished(false), _ctx(nullptr)
+        {
+        }
+
+        bool Reset(Codec, uint8_t dictionary = 0);
+
+        // consumes input from `*in' and writes at most `*outSize' bytes to `out'. `*in' and
+        // `*inSize' are advanced past the consumed input, `*outSize' is set to the number of
+        // bytes written. Returns false on corrupt input.
+        bool Decompress(const char** in, size_t* inSize, char* out, size_t* outSize);
+
+        // true once the end of the compressed stream has been decoded
+        bool Finished() const
+        {
+            return _finished;
+        }
+    };
+
+    // compressed payloads are inflated in blocks of this size while the message is parsed
+    static constexpr size_t FRAME_STREAM_BLOCK_SIZE = 32 * 1024;
+
+    // the serialized message of one frame, read from the pieces its payload arrived in.
+    // Compressed payloads are inflated one block at a time as protobuf asks for more, and every
+    // byte is fed to the frame checksum as it is produced, so parsing needs neither the payload
+    // in one piece nor a buffer for the whole message.
+    class FrameInputStream : public google::protobuf::io::ZeroCopyInputStream
+    {
+    public:
+        struct Segment {
+            const char* data;
+            size_t size;
+        };
+
+    private:
+        const Segment* _segments;
+        size_t _segmentCount;
+        size_t _segment;
+        size_t _offset;
+
+        Codec _codec;
+        StreamDecompressor _decompressor;
+        DigestContext& _digest;
 
-        char header_buffer[PACKAGE_HEADER_SIZE];
+        size_t _serialSize;
+        size_t _produced;
+        int64_t _count;
+
+        const char* _block;
+        size_t _blockSize;
+        size_t _backup;
+        bool _failed;
+
+        bool produce();
+
+    public:
+        FrameInputStream(Codec,
+                         uint8_t dictionary,
+                         DigestContext&,
+                         const Segment*,
+                         size_t count,
+                         size_t serialSize);
+
+        bool Next(const void** data, int* size) override;
+
+        void BackUp(int count) override;
+
+        bool Skip(int count) override;
+
+        int64_t ByteCount() const override;
+
+        // true if exactly `serialSize' bytes were produced and the payload held nothing
+        // after them
+        bool Finish();
+    };
+
+    // payload bytes of a partially received frame, kept in fixed-size chunks so a large
+    // frame is never grown or moved in one piece. Chunks come from the buffer pool, each
+    // filling a 16 KiB class exactly.
+    class ChunkChain
+    {
+        std::vector<char*> _chunks;
+        size_t _size;
+
+    public:
+        static constexpr size_t CHUNK_SIZE = 16 * 1024 - BUFFER_HEADER_SIZE;
+
+        ChunkChain() : _size(0) {}
+
+        ~ChunkChain();
+
+        ChunkChain(const ChunkChain&) = delete;
+        ChunkChain& operator=(const ChunkChain&) = delete;
+
+        size_t size() const
+        {
+            return _size;
+        }
+
+        bool empty() const
+        {
+            return _size == 0;
+        }
+
+        void append(const char*, size_t);
+
+        // appends the stored bytes to `out', one segment per chunk
+        void segments(std::vector<FrameInputStream::Segment>& out) const;
+
+        void clear();
+    };
+
+    // messages to be sent together. Each is converted to its protobuf form when it is added,
+    // so it need not outlive Add(). Encode() puts them under one frame header, compressed and
+    // checksummed once, if the peer decodes batch frames, or into consecutive frames of one
+    // buffer if it does not.
+    class FrameBatch
+    {
+        coreBatch _batch;
+
+    public:
+        void Add(CoreMessage&, const FrameOption& = FrameOption());
+
+        size_t Size() const
+        {
+            return static_cast<size_t>(_batch.messages_size());
+        }
+
+        bool Empty() const
+        {
+            return _batch.messages_size() == 0;
+        }
+
+        // builds the frames into a pooled buffer and empties the batch
+        bool Encode(char** ptr,
+                    size_t* size,
+                    const FrameOption& = FrameOption(),
+                    FrameStatistics* = nullptr);
+
+        void Clear()
+        {
+            _batch.Clear();
+        }
+    };
+
+    class ProtobufPacketDecoder
+    {
+        std::deque<CoreMessage*> _vec;
 
         std::mutex _mutex;
-        std::stringstream _buf;
 
-        void parseHeader(char*, size_t);
-        CoreMessage* _read(void*, size_t);
+        // the frame being received: its header, then its payload as it arrives
+        char _header[PACKAGE_HEADER_SIZE];
+        size_t _headerFill;
+        ChunkChain _payload;
+
+        std::vector<FrameInputStream::Segment> _segments;
+        DigestContext _digest;
+
+        FrameStatistics* _stats;
+        bool _views;
+
+        // frames that could not be decoded, and whether the stream is beyond recovery
+        uint64_t _errors;
+        bool _failed;
+        size_t _maxFrameSize;
+
+        static size_t headerSize(const char*);
+        static size_t payloadSize(const char*);
+        bool oversized(const char* header) const;
+        void decodeFrame(const char* header);
 
     public:
-        static void ProtobufPacketEncoder(char**, size_t& size, std::vector<const CoreMessage&>);
         static void ProtobufPacketEncoder(char**, size_t& size, CoreMessage&);
 
+        // all of `msgs' in one buffer, as a FrameBatch encodes them
+        static bool ProtobufPacketEncoder(char**,
+                                          size_t& size,
+                                          const std::vector<CoreMessage*>& msgs,
+                                          const FrameOption& = FrameOption(),
+                                          FrameStatistics* = nullptr);
+
         auto GetSize()
         {
             std::lock_guard<std::mutex> lock(_mutex);
@@ -481,8 +1203,9 @@ namespace protobuf
                 delete p;
             }
             _vec.clear();
-            _buf.clear();
-            compressSize = remainSize = headerSize = 0;
+            _headerFill = 0;
+            _payload.clear();
+            _failed = false;
         }
 
         ~ProtobufPacketDecoder()
@@ -490,23 +1213,69 @@ namespace protobuf
             Reset();
         }
 
-        ProtobufPacketDecoder() : compressSize(0), remainSize(0), serialSize(0), headerSize(0)
+        ProtobufPacketDecoder()
+            : _headerFill(0),
+              _stats(nullptr),
+              _views(false),
+              _errors(0),
+              _failed(false),
+              _maxFrameSize(PACKAGE_DEFAULT_MAX_FRAME_SIZE)
+        {
+        }
+
+        void SetStatistics(FrameStatistics* stats)
+        {
+            _stats = stats;
+        }
+
+        // UPDATE_LOG frames decode into a LogPackageView instead of a LogPackage
+        void DecodeLogPackageViews(bool views)
         {
-            memset(header_buffer, 0, sizeof header_buffer);
+            _views = views;
         }
 
-        CoreMessage* read(void*, size_t);
+        // frames whose header claims more bytes than this, serialized or on the wire, are
+        // refused before anything is allocated for them
+        void SetMaxFrameSize(size_t size)
+        {
+            _maxFrameSize = size;
+        }
+
+        // frames dropped so far: corrupt, failing their checksum, too large or using a codec,
+        // checksum or dictionary this side does not have. Data of the peer can no longer be
+        // trusted once this grows; after a frame too large the decoder ignores the rest of the
+        // stream until Reset().
+        uint64_t Errors()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _errors;
+        }
+
+        // decodes every frame completed by these bytes and queues the messages for
+        // GetProtobufMessage(). Returns the number of messages queued by this call.
+        size_t read(const void*, size_t);
     };
 
 }  // namespace protobuf
 
 protobuf::OsType getOsType();
 
-const char* SHA256(void*, size_t);
-
-size_t CompressSizeBound(size_t);
-bool Compress(char**, size_t*, const char*, size_t);
-bool DeCompress(char*, size_t*, const char*, size_t);
+void SHA256(const void*, size_t, char* out);
+
+// incremental SHA-256: SHA256End() writes the digest and releases the context
+void* SHA256Begin();
+void SHA256Update(void*, const void*, size_t);
+void SHA256End(void*, char* out);
+
+size_t CompressSizeBound(protobuf::Codec, size_t);
+bool Compress(protobuf::Codec,
+              int level,
+              char*,
+              size_t*,
+              const char*,
+              size_t,
+              uint8_t dictionary = 0);
+bool DeCompress(protobuf::Codec, char*, size_t*, const char*, size_t, uint8_t dictionary = 0);
 
 
 #endif
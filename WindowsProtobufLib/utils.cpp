@@ -3,7 +3,20 @@
 
 #include <zlib.h>
 
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
 #include <cassert>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <ctime>
+#include <map>
 
 using namespace protobuf;
 
@@ -25,84 +38,160 @@ using namespace protobuf;
 #endif
 
 #if defined _WINDOWS_ || defined WINDOWS
-const char* SHA256(void* data, size_t size)
+namespace
+{
+    struct Sha256State {
+        BCRYPT_ALG_HANDLE hAlg;
+        BCRYPT_HASH_HANDLE hHash;
+        PBYTE pbHashObject;
+    };
+}  // namespace
+
+void* SHA256Begin()
 {
     // https://docs.microsoft.com/en-us/windows/win32/seccng/creating-a-hash-with-cng
-    BCRYPT_ALG_HANDLE hAlg = NULL;
-    BCRYPT_HASH_HANDLE hHash = NULL;
+    auto state = new Sha256State;
+    state->hAlg = NULL;
+    state->hHash = NULL;
+    state->pbHashObject = NULL;
 
     NTSTATUS status = -1;
-    DWORD cbData = 0, cbHash = 0, cbHashObject = 0;
-    PBYTE pbHashObject = NULL;
-    PBYTE pbHash = NULL;
+    DWORD cbData = 0, cbHashObject = 0;
 
-    status = BCryptOpenAlgorithmProvider(&hAlg, BCRYPT_SHA256_ALGORITHM, NULL, 0);
+    status = BCryptOpenAlgorithmProvider(&state->hAlg, BCRYPT_SHA256_ALGORITHM, NULL, 0);
 
     assert(status == STATUS_SUCCESS);
 
     status = BCryptGetProperty(
-        hAlg, BCRYPT_OBJECT_LENGTH, (PBYTE)&cbHashObject, sizeof(DWORD), &cbData, 0);
+        state->hAlg, BCRYPT_OBJECT_LENGTH, (PBYTE)&cbHashObject, sizeof(DWORD), &cbData, 0);
 
     assert(status == STATUS_SUCCESS);
 
-    pbHashObject = (PBYTE)HeapAlloc(GetProcessHeap(), 0, cbHashObject);
-    assert(pbHashObject != nullptr);
+    state->pbHashObject = (PBYTE)HeapAlloc(GetProcessHeap(), 0, cbHashObject);
+    assert(state->pbHashObject != nullptr);
 
-    status = BCryptGetProperty(hAlg, BCRYPT_HASH_LENGTH, (PBYTE)&cbHash, sizeof(DWORD), &cbData, 0);
+    status = BCryptCreateHash(
+        state->hAlg, &state->hHash, state->pbHashObject, cbHashObject, NULL, 0, 0);
 
     assert(status == STATUS_SUCCESS);
 
-    pbHash = new BYTE[cbHash];
-    assert(pbHash != nullptr);
+    return state;
+}
 
-    status = BCryptCreateHash(hAlg, &hHash, pbHashObject, cbHashObject, NULL, 0, 0);
+void SHA256Update(void* ctx, const void* data, size_t size)
+{
+    auto state = reinterpret_cast<Sha256State*>(ctx);
+    NTSTATUS status = BCryptHashData(state->hHash, (PBYTE)data, size, 0);
 
     assert(status == STATUS_SUCCESS);
+}
 
-    status = BCryptHashData(hHash, (PBYTE)data, size, 0);
+void SHA256End(void* ctx, char* out)
+{
+    auto state = reinterpret_cast<Sha256State*>(ctx);
+    NTSTATUS status = BCryptFinishHash(state->hHash, (PBYTE)out, 32, 0);
 
     assert(status == STATUS_SUCCESS);
 
-    status = BCryptFinishHash(hHash, pbHash, cbHash, 0);
-
-clean:
-    if (hAlg) {
-        BCryptCloseAlgorithmProvider(hAlg, 0);
+    if (state->hAlg) {
+        BCryptCloseAlgorithmProvider(state->hAlg, 0);
     }
 
-    if (hHash) {
-        BCryptDestroyHash(hHash);
+    if (state->hHash) {
+        BCryptDestroyHash(state->hHash);
     }
 
-    if (pbHashObject) {
-        HeapFree(GetProcessHeap(), 0, pbHashObject);
+    if (state->pbHashObject) {
+        HeapFree(GetProcessHeap(), 0, state->pbHashObject);
     }
-
-    return (char*)pbHash;
+    delete state;
 }
 
-
 #else
-const char* SHA256(void* data, size_t size)
+void* SHA256Begin()
 {
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, data, size);
-    SHA256_Final(hash, &sha256);
-
-    char* ret = new char[SHA256_DIGEST_LENGTH];
+    auto sha256 = new SHA256_CTX;
+    SHA256_Init(sha256);
+    return sha256;
+}
 
-    memcpy(ret, hash, SHA256_DIGEST_LENGTH);
+void SHA256Update(void* ctx, const void* data, size_t size)
+{
+    SHA256_Update(reinterpret_cast<SHA256_CTX*>(ctx), data, size);
+}
 
-    return ret;
+void SHA256End(void* ctx, char* out)
+{
+    auto sha256 = reinterpret_cast<SHA256_CTX*>(ctx);
+    SHA256_Final(reinterpret_cast<unsigned char*>(out), sha256);
+    delete sha256;
 }
 
 #endif
 
+void SHA256(const void* data, size_t size, char* out)
+{
+    auto ctx = SHA256Begin();
+    SHA256Update(ctx, data, size);
+    SHA256End(ctx, out);
+}
+
 namespace
 {
-    std::string timeBias = "+0";
+    std::string timeBias = "+00:00";
+
+    // "+hh:mm" of an offset east of UTC, minutes kept for the half and quarter hour zones
+    void formatTimeBias(char* text, size_t size, long offsetMinutes)
+    {
+        long minutes = std::labs(offsetMinutes);
+        snprintf(text,
+                 size,
+                 "%c%02ld:%02ld",
+                 offsetMinutes < 0 ? '-' : '+',
+                 minutes / 60,
+                 minutes % 60);
+    }
+
+    // coarse clocks only tick every few milliseconds, but cost a fraction of a precise read
+    int64_t monotonicMicroseconds()
+    {
+#if defined _WINDOWS_ || defined WINDOWS
+        return static_cast<int64_t>(GetTickCount64()) * 1000;
+#elif defined CLOCK_MONOTONIC_COARSE
+        timespec t;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+        return static_cast<int64_t>(t.tv_sec) * 1000000 + t.tv_nsec / 1000;
+#else
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+#endif
+    }
+
+    int64_t wallMicroseconds()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // the monotonic clock is anchored to the wall clock again once a minute, so steps of the
+    // wall clock show up within that time
+    constexpr int64_t CLOCK_ANCHOR_INTERVAL = 60 * 1000000;
+    std::atomic<int64_t> epochOffset{0};
+    std::atomic<int64_t> nextClockAnchor{INT64_MIN};
+
+    // getTimeStamp() text of the last millisecond seen by this thread. Only the milliseconds
+    // are rewritten while the second stays the same.
+    struct TimeStampCache {
+        // "YYYY-MM-DD hh:mm:ss." precedes the milliseconds
+        static constexpr int MILLISECOND_OFFSET = 20;
+
+        int64_t second = -1;
+        int64_t millisecond = -1;
+        int size = 0;
+        char text[64];
+    };
 
     const size_t UUID_LENGTH = 36;
 
@@ -284,7 +373,8 @@ namespace
 
         size_t l = snprintf(result, UUID_LENGTH * 2 + 2, "%s+%s", b, p);
 
-        auto sha = SHA256(result, l);
+        char sha[32];
+        SHA256(result, l, sha);
 
         RPC_CSTR resultUUID;
 
@@ -296,7 +386,6 @@ namespace
 
         delete[] biosUUID;
         delete[] windowsMachineID;
-        delete[] sha;
 
         RpcStringFreeA(&b);
         RpcStringFreeA(&p);
@@ -336,13 +425,9 @@ void initGetTimestamp()
     TIME_ZONE_INFORMATION tzInfo;
     DWORD status = GetTimeZoneInformation(&tzInfo);
     if (status >= 0) {
-        auto tb = tzInfo.Bias / -60;
-        if (tb > 0) {
-            timeBias = "+";
-            timeBias += std::to_string(tb);
-        } else if (tb < 0) {
-            timeBias = std::to_string(tb);
-        }
+        char bias[24];
+        formatTimeBias(bias, sizeof bias, -static_cast<long>(tzInfo.Bias));
+        timeBias = bias;
     }
 #endif
 }
@@ -352,27 +437,54 @@ void shutdownProtobufLibrary()
     google::protobuf::ShutdownProtobufLibrary();
 }
 
+int64_t getEpochMicroseconds()
+{
+    int64_t now = monotonicMicroseconds();
+    if (now >= nextClockAnchor.load(std::memory_order_acquire)) {
+        epochOffset.store(wallMicroseconds() - now, std::memory_order_relaxed);
+        nextClockAnchor.store(now + CLOCK_ANCHOR_INTERVAL, std::memory_order_release);
+    }
+    return now + epochOffset.load(std::memory_order_relaxed);
+}
+
 void getTimeStamp(std::string& ts)
 {
+    thread_local TimeStampCache cache;
+
+    int64_t ms = getEpochMicroseconds() / 1000;
+    if (ms != cache.millisecond) {
+        int64_t second = ms / 1000;
+        if (second != cache.second) {
+            time_t t = static_cast<time_t>(second);
+            struct tm local;
 #if defined _WINDOWS_ || defined WINDOWS
-    SYSTEMTIME t;
-    GetLocalTime(&t);
-    const int bufferSize = 1024;
-    char buffer[bufferSize];
-    snprintf(buffer,
-             bufferSize,
-             "%4d-%02d-%02d %02d:%02d:%02d.%d%s",
-             t.wYear,
-             t.wMonth,
-             t.wDay,
-             t.wHour,
-             t.wMinute,
-             t.wSecond,
-             t.wMilliseconds,
-             timeBias.c_str());
-    ts = buffer;
+            localtime_s(&local, &t);
+            const char* bias = timeBias.c_str();
 #else
+            localtime_r(&t, &local);
+            char bias[24];
+            formatTimeBias(bias, sizeof bias, static_cast<long>(local.tm_gmtoff / 60));
 #endif
+            cache.size = snprintf(cache.text,
+                                  sizeof cache.text,
+                                  "%04d-%02d-%02d %02d:%02d:%02d.000%s",
+                                  local.tm_year + 1900,
+                                  local.tm_mon + 1,
+                                  local.tm_mday,
+                                  local.tm_hour,
+                                  local.tm_min,
+                                  local.tm_sec,
+                                  bias);
+            cache.second = second;
+        }
+        int milli = static_cast<int>(ms % 1000);
+        char* p = cache.text + TimeStampCache::MILLISECOND_OFFSET;
+        p[0] = static_cast<char>('0' + milli / 100);
+        p[1] = static_cast<char>('0' + milli / 10 % 10);
+        p[2] = static_cast<char>('0' + milli % 10);
+        cache.millisecond = ms;
+    }
+    ts.assign(cache.text, cache.size);
 }
 
 protobuf::OsType getOsType()
@@ -461,23 +573,479 @@ void initProtobufLibrary(const std::string&)
     initGetTimestamp();
 }
 
-size_t CompressSizeBound(size_t s)
+namespace
 {
-    return compressBound(s);
-}
+    // zlib streams kept per thread, so a frame does not pay for setting up the deflate and
+    // inflate state (several hundred KiB) every time.
+    struct ZlibStreams {
+        z_stream deflater;
+        z_stream inflater;
+        int level;
+        bool deflaterReady;
+        bool inflaterReady;
+
+        ZlibStreams() : level(0), deflaterReady(false), inflaterReady(false)
+        {
+            memset(&deflater, 0, sizeof deflater);
+            memset(&inflater, 0, sizeof inflater);
+        }
+
+        ~ZlibStreams()
+        {
+            if (deflaterReady) {
+                deflateEnd(&deflater);
+            }
+            if (inflaterReady) {
+                inflateEnd(&inflater);
+            }
+        }
+
+        z_stream* GetDeflater(int l)
+        {
+            if (deflaterReady && level != l) {
+                deflateEnd(&deflater);
+                deflaterReady = false;
+            }
+            if (!deflaterReady) {
+                if (deflateInit(&deflater, l) != Z_OK) {
+                    return nullptr;
+                }
+                deflaterReady = true;
+                level = l;
+            } else {
+                deflateReset(&deflater);
+            }
+            return &deflater;
+        }
+
+        z_stream* GetInflater()
+        {
+            if (!inflaterReady) {
+                if (inflateInit(&inflater) != Z_OK) {
+                    return nullptr;
+                }
+                inflaterReady = true;
+            } else {
+                inflateReset(&inflater);
+            }
+            return &inflater;
+        }
+    };
+
+    ZlibStreams& zlibStreams()
+    {
+        thread_local ZlibStreams streams;
+        return streams;
+    }
+
+#ifdef HAVE_ZSTD
+    struct ZstdContext {
+        ZSTD_CCtx* cctx;
+        ZSTD_DCtx* dctx;
+
+        // digested dictionaries, by id and, for compression, level. Building one costs far
+        // more than a frame, and dictionaries are never unloaded.
+        std::map<std::pair<uint8_t, int>, ZSTD_CDict*> cdicts;
+        std::map<uint8_t, ZSTD_DDict*> ddicts;
+
+        ZstdContext() : cctx(ZSTD_createCCtx()), dctx(ZSTD_createDCtx()) {}
+
+        ~ZstdContext()
+        {
+            ZSTD_freeCCtx(cctx);
+            ZSTD_freeDCtx(dctx);
+            for (auto& d : cdicts) {
+                ZSTD_freeCDict(d.second);
+            }
+            for (auto& d : ddicts) {
+                ZSTD_freeDDict(d.second);
+            }
+        }
+
+        ZSTD_CDict* GetCDict(uint8_t id, int level)
+        {
+            auto& d = cdicts[std::make_pair(id, level)];
+            if (d == nullptr) {
+                auto content = GetDictionary(id);
+                d = ZSTD_createCDict(content->data(), content->size(), level);
+            }
+            return d;
+        }
 
-bool Compress(char** out, size_t* outSize, const char* in, size_t inSize)
+        ZSTD_DDict* GetDDict(uint8_t id)
+        {
+            auto& d = ddicts[id];
+            if (d == nullptr) {
+                auto content = GetDictionary(id);
+                d = ZSTD_createDDict(content->data(), content->size());
+            }
+            return d;
+        }
+    };
+
+    ZstdContext& zstdContext()
+    {
+        thread_local ZstdContext ctx;
+        return ctx;
+    }
+#endif
+
+#ifdef HAVE_LZ4
+    struct Lz4Context {
+        LZ4F_dctx* dctx;
+
+        Lz4Context() : dctx(nullptr)
+        {
+            LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+        }
+
+        ~Lz4Context()
+        {
+            LZ4F_freeDecompressionContext(dctx);
+        }
+    };
+
+    Lz4Context& lz4Context()
+    {
+        thread_local Lz4Context ctx;
+        return ctx;
+    }
+#endif
+}  // namespace
+
+uint32_t protobuf::SupportedCodecs()
 {
-    *outSize = 0;
-    auto bs = compressBound(inSize);
-    uLongf os = bs;
-    *out = new char[bs];
-    auto ret = (Z_OK == ::compress2((Bytef*)*out, &os, (Bytef*)in, inSize, Z_BEST_COMPRESSION));
-    *outSize = os;
+    uint32_t ret = (1u << static_cast<int>(Codec::none)) | (1u << static_cast<int>(Codec::zlib));
+#ifdef HAVE_LZ4
+    ret |= 1u << static_cast<int>(Codec::lz4);
+#endif
+#ifdef HAVE_ZSTD
+    ret |= 1u << static_cast<int>(Codec::zstd);
+#endif
     return ret;
 }
 
-bool DeCompress(char* out, size_t* outSize, const char* in, size_t inSize)
+const char* protobuf::CodecName(Codec c)
+{
+    switch (c) {
+        case Codec::none:
+            return "none";
+        case Codec::zlib:
+            return "zlib";
+        case Codec::lz4:
+            return "lz4";
+        case Codec::zstd:
+            return "zstd";
+        default:
+            break;
+    }
+    return "unknown";
+}
+
+bool protobuf::ParseCodec(const std::string& name, Codec& c)
+{
+    for (int i = 0; i < CODEC_COUNT; i++) {
+        if (name == CodecName(static_cast<Codec>(i))) {
+            c = static_cast<Codec>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool protobuf::CodecLevelValid(Codec c, int level)
+{
+    switch (c) {
+        case Codec::none:
+            return true;
+        case Codec::zlib:
+            return level == Z_DEFAULT_COMPRESSION || (level >= 0 && level <= Z_BEST_COMPRESSION);
+#ifdef HAVE_ZSTD
+        case Codec::zstd:
+            return level >= ZSTD_minCLevel() && level <= ZSTD_maxCLevel();
+#endif
+#ifdef HAVE_LZ4
+        case Codec::lz4:
+            // negative levels are the fast modes
+            return level <= LZ4F_compressionLevel_max();
+#endif
+        default:
+            break;
+    }
+    return false;
+}
+
+size_t CompressSizeBound(Codec c, size_t s)
+{
+    switch (c) {
+        case Codec::zlib:
+            return compressBound(s);
+#ifdef HAVE_ZSTD
+        case Codec::zstd:
+            return ZSTD_compressBound(s);
+#endif
+#ifdef HAVE_LZ4
+        case Codec::lz4:
+            return LZ4F_compressFrameBound(s, nullptr);
+#endif
+        default:
+            break;
+    }
+    return s;
+}
+
+bool Compress(Codec c,
+              int level,
+              char* out,
+              size_t* outSize,
+              const char* in,
+              size_t inSize,
+              uint8_t dictionary)
 {
-    return Z_OK == uncompress((Bytef*)out, (uLongf*)outSize, (const Bytef*)in, inSize);
+    // `out' is owned by the caller and must hold at least CompressSizeBound(c, inSize) bytes.
+    // `dictionary' must be loaded and usable with `c', or 0.
+    assert(dictionary == 0 || (GetDictionary(dictionary) != nullptr && CodecUsesDictionary(c)));
+    switch (c) {
+        case Codec::none:
+            if (*outSize < inSize) {
+                return false;
+            }
+            memcpy(out, in, inSize);
+            *outSize = inSize;
+            return true;
+        case Codec::zlib: {
+            z_stream* zs = zlibStreams().GetDeflater(level);
+            if (zs == nullptr) {
+                return false;
+            }
+            if (dictionary != 0) {
+                auto d = GetDictionary(dictionary);
+                deflateSetDictionary(zs, (const Bytef*)d->data(), d->size());
+            }
+            zs->next_in = (Bytef*)in;
+            zs->avail_in = inSize;
+            zs->next_out = (Bytef*)out;
+            zs->avail_out = *outSize;
+            auto ret = ::deflate(zs, Z_FINISH);
+            *outSize = zs->total_out;
+            return ret == Z_STREAM_END;
+        }
+#ifdef HAVE_ZSTD
+        case Codec::zstd: {
+            auto& ctx = zstdContext();
+            size_t ret;
+            if (dictionary == 0) {
+                ret = ZSTD_compressCCtx(ctx.cctx, out, *outSize, in, inSize, level);
+            } else {
+                ret = ZSTD_compress_usingCDict(
+                    ctx.cctx, out, *outSize, in, inSize, ctx.GetCDict(dictionary, level));
+            }
+            if (ZSTD_isError(ret)) {
+                return false;
+            }
+            *outSize = ret;
+            return true;
+        }
+#endif
+#ifdef HAVE_LZ4
+        case Codec::lz4: {
+            LZ4F_preferences_t prefs;
+            memset(&prefs, 0, sizeof prefs);
+            prefs.compressionLevel = level;
+            auto ret = LZ4F_compressFrame(out, *outSize, in, inSize, &prefs);
+            if (LZ4F_isError(ret)) {
+                return false;
+            }
+            *outSize = ret;
+            return true;
+        }
+#endif
+        default:
+            break;
+    }
+    return false;
+}
+
+bool DeCompress(Codec c,
+                char* out,
+                size_t* outSize,
+                const char* in,
+                size_t inSize,
+                uint8_t dictionary)
+{
+    if (dictionary != 0 && (GetDictionary(dictionary) == nullptr || !CodecUsesDictionary(c))) {
+        return false;
+    }
+    switch (c) {
+        case Codec::none:
+            if (*outSize < inSize) {
+                return false;
+            }
+            memcpy(out, in, inSize);
+            *outSize = inSize;
+            return true;
+        case Codec::zlib: {
+            z_stream* zs = zlibStreams().GetInflater();
+            if (zs == nullptr) {
+                return false;
+            }
+            zs->next_in = (Bytef*)in;
+            zs->avail_in = inSize;
+            zs->next_out = (Bytef*)out;
+            zs->avail_out = *outSize;
+            auto ret = ::inflate(zs, Z_FINISH);
+            if (ret == Z_NEED_DICT && dictionary != 0) {
+                auto d = GetDictionary(dictionary);
+                if (inflateSetDictionary(zs, (const Bytef*)d->data(), d->size()) != Z_OK) {
+                    return false;
+                }
+                ret = ::inflate(zs, Z_FINISH);
+            }
+            *outSize = zs->total_out;
+            return ret == Z_STREAM_END;
+        }
+#ifdef HAVE_ZSTD
+        case Codec::zstd: {
+            auto& ctx = zstdContext();
+            size_t ret;
+            if (dictionary == 0) {
+                // the context may still reference the dictionary of a streamed frame
+                ZSTD_DCtx_refDDict(ctx.dctx, nullptr);
+                ret = ZSTD_decompressDCtx(ctx.dctx, out, *outSize, in, inSize);
+            } else {
+                ret = ZSTD_decompress_usingDDict(
+                    ctx.dctx, out, *outSize, in, inSize, ctx.GetDDict(dictionary));
+            }
+            if (ZSTD_isError(ret)) {
+                return false;
+            }
+            *outSize = ret;
+            return true;
+        }
+#endif
+#ifdef HAVE_LZ4
+        case Codec::lz4: {
+            auto dctx = lz4Context().dctx;
+            size_t dstSize = *outSize, srcSize = inSize;
+            LZ4F_resetDecompressionContext(dctx);
+            auto ret = LZ4F_decompress(dctx, out, &dstSize, in, &srcSize, nullptr);
+            *outSize = dstSize;
+            return ret == 0 && srcSize == inSize;
+        }
+#endif
+        default:
+            break;
+    }
+    return false;
+}
+
+bool StreamDecompressor::Reset(Codec c, uint8_t dictionary)
+{
+    _codec = c;
+    _dictionary = dictionary;
+    _finished = false;
+    _ctx = nullptr;
+    if (dictionary != 0 && (GetDictionary(dictionary) == nullptr || !CodecUsesDictionary(c))) {
+        return false;
+    }
+    switch (c) {
+        case Codec::none:
+            return true;
+        case Codec::zlib:
+            _ctx = zlibStreams().GetInflater();
+            return _ctx != nullptr;
+#ifdef HAVE_ZSTD
+        case Codec::zstd: {
+            auto& ctx = zstdContext();
+            _ctx = ctx.dctx;
+            ZSTD_DCtx_reset(ctx.dctx, ZSTD_reset_session_only);
+            ZSTD_DCtx_refDDict(ctx.dctx, dictionary == 0 ? nullptr : ctx.GetDDict(dictionary));
+            return true;
+        }
+#endif
+#ifdef HAVE_LZ4
+        case Codec::lz4:
+            _ctx = lz4Context().dctx;
+            LZ4F_resetDecompressionContext(reinterpret_cast<LZ4F_dctx*>(_ctx));
+            return true;
+#endif
+        default:
+            break;
+    }
+    return false;
+}
+
+bool StreamDecompressor::Decompress(const char** in, size_t* inSize, char* out, size_t* outSize)
+{
+    switch (_codec) {
+        case Codec::none: {
+            size_t n = std::min(*inSize, *outSize);
+            memcpy(out, *in, n);
+            *in += n;
+            *inSize -= n;
+            *outSize = n;
+            return true;
+        }
+        case Codec::zlib: {
+            auto zs = reinterpret_cast<z_stream*>(_ctx);
+            zs->next_in = (Bytef*)*in;
+            zs->avail_in = *inSize;
+            zs->next_out = (Bytef*)out;
+            zs->avail_out = *outSize;
+            auto ret = ::inflate(zs, Z_NO_FLUSH);
+            if (ret == Z_NEED_DICT && _dictionary != 0) {
+                auto d = GetDictionary(_dictionary);
+                if (inflateSetDictionary(zs, (const Bytef*)d->data(), d->size()) != Z_OK) {
+                    return false;
+                }
+                ret = ::inflate(zs, Z_NO_FLUSH);
+            }
+            *in += *inSize - zs->avail_in;
+            *inSize = zs->avail_in;
+            *outSize -= zs->avail_out;
+            if (ret == Z_STREAM_END) {
+                _finished = true;
+            }
+            // Z_BUF_ERROR only means no progress was possible with this input
+            return ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR;
+        }
+#ifdef HAVE_ZSTD
+        case Codec::zstd: {
+            ZSTD_inBuffer input = {*in, *inSize, 0};
+            ZSTD_outBuffer output = {out, *outSize, 0};
+            auto ret =
+                ZSTD_decompressStream(reinterpret_cast<ZSTD_DCtx*>(_ctx), &output, &input);
+            if (ZSTD_isError(ret)) {
+                return false;
+            }
+            *in += input.pos;
+            *inSize -= input.pos;
+            *outSize = output.pos;
+            if (ret == 0) {
+                _finished = true;
+            }
+            return true;
+        }
+#endif
+#ifdef HAVE_LZ4
+        case Codec::lz4: {
+            size_t dstSize = *outSize, srcSize = *inSize;
+            auto ret = LZ4F_decompress(
+                reinterpret_cast<LZ4F_dctx*>(_ctx), out, &dstSize, *in, &srcSize, nullptr);
+            if (LZ4F_isError(ret)) {
+                return false;
+            }
+            *in += srcSize;
+            *inSize -= srcSize;
+            *outSize = dstSize;
+            if (ret == 0) {
+                _finished = true;
+            }
+            return true;
+        }
+#endif
+        default:
+            break;
+    }
+    return false;
 }
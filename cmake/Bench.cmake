@@ -0,0 +1,20 @@
+include(ExternalProject)
+
+ExternalProject_Add(
+  googlebenchmark
+  URL https://github.com/google/benchmark/archive/v1.5.2.zip
+  DOWNLOAD_NO_PROGRESS ON
+  PREFIX googlebenchmark
+  CMAKE_ARGS -DCMAKE_BUILD_TYPE=Release -DBENCHMARK_ENABLE_TESTING=OFF -DBENCHMARK_ENABLE_GTEST_TESTS=OFF
+  INSTALL_COMMAND "")
+
+ExternalProject_Get_Property(googlebenchmark source_dir binary_dir)
+
+add_library(libbenchmark IMPORTED STATIC GLOBAL)
+add_dependencies(libbenchmark googlebenchmark)
+
+set_target_properties(libbenchmark PROPERTIES
+  IMPORTED_LOCATION ${binary_dir}/src/libbenchmark.a
+  IMPORTED_LINK_INTERFACE_LIBRARIES ${CMAKE_THREAD_LIBS_INIT})
+
+include_directories(${source_dir}/include)
@@ -59,6 +59,7 @@ CREATE TABLE public."WindowsEvents"
     "EventTimestamp" timestamp with time zone NOT NULL,
     "EventScope" text COLLATE pg_catalog."default" NOT NULL,
     "EventMessage" text COLLATE pg_catalog."default" NOT NULL,
+    "EventRecordID" bigint NOT NULL DEFAULT 0,
     CONSTRAINT "WindowsEvents_pkey" PRIMARY KEY ("EventID"),
     CONSTRAINT "FK_ClientID" FOREIGN KEY ("ClientID")
         REFERENCES public."Client" ("ClientID") MATCH SIMPLE
@@ -72,6 +73,11 @@ TABLESPACE pg_default;
 ALTER TABLE public."WindowsEvents"
     OWNER to postgres;
 
+CREATE INDEX "WindowsEvents_ClientID_EventRecordID"
+    ON public."WindowsEvents" USING btree
+    ("ClientID", "EventRecordID")
+    TABLESPACE pg_default;
+
 CREATE TABLE public."WindowsEventsXML"
 (
     "EventID" integer NOT NULL DEFAULT nextval('"WindowsEventsXML_EventID_seq"'::regclass),